@@ -1,5 +1,7 @@
 # include <stdlib.h>
 # include <stdint.h>
+# include <stdarg.h>
+# include <string.h>
 # ifndef WIN32
 # include <unistd.h>
 # endif
@@ -8,6 +10,7 @@
 # include <stdio.h>
 extern "C" {
 # include "lpc_ext.h"
+# include "jit.h"
 }
 # include "data.h"
 # include "instruction.h"
@@ -24,6 +27,9 @@ extern "C" {
 # define TARGET_TRIPLE "x86_64-pc-windows-msvc"
 # endif
 # include "genclang.h"
+# ifdef LLVM
+# include "llvmcomp.h"
+# endif
 # include "jitcomp.h"
 
 # ifdef LARGENUM
@@ -38,255 +44,266 @@ extern "C" {
 # define DOUBLE_SIZE	8
 # endif
 # undef  LLVM3_6	/* generate IR for LLVM 3.5 and 3.6 */
+# undef  KEEP_IR	/* also write .ll files for the LLVM backend */
+
+/* call attributes, nounwind if none given */
+# define NOUNWIND	"#2"		/* errors do not unwind */
+# define READ_VM	"#3"		/* only reads VM state */
+
+# define COLD_WEIGHT	2000		/* hot to cold branch weight */
+# define RANGE_CASES	128		/* max # expanded range values */
 
 static const struct {
     const char *ret;			/* return value */
     const char *args;			/* function arguments */
+    const char *attributes;		/* call attributes */
 } functions[] = {
 # define VM_INT				0
-    { "void", "(i8*, " Int ")" },
+    { "void", "(i8*, " Int ")", NULL },
 # define VM_FLOAT			1
-    { "void", "(i8*, " Double ")" },
+    { "void", "(i8*, " Double ")", NULL },
 # define VM_STRING			2
-    { "void", "(i8*, i16, i16)" },
+    { "void", "(i8*, i16, i16)", NULL },
 # define VM_PARAM			3
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_PARAM_INT			4
-    { Int, "(i8*, i8)" },
+    { Int, "(i8*, i8)", READ_VM },
 # define VM_PARAM_FLOAT			5
-    { Double, "(i8*, i8)" },
+    { Double, "(i8*, i8)", READ_VM },
 # define VM_LOCAL			6
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_LOCAL_INT			7
-    { Int, "(i8*, i8)" },
+    { Int, "(i8*, i8)", READ_VM },
 # define VM_LOCAL_FLOAT			8
-    { Double, "(i8*, i8)" },
+    { Double, "(i8*, i8)", READ_VM },
 # define VM_GLOBAL			9
-    { "void", "(i8*, i16, i8)" },
+    { "void", "(i8*, i16, i8)", NULL },
 # define VM_GLOBAL_INT			10
-    { Int, "(i8*, i16, i8)" },
+    { Int, "(i8*, i16, i8)", NULL },
 # define VM_GLOBAL_FLOAT		11
-    { Double, "(i8*, i16, i8)" },
+    { Double, "(i8*, i16, i8)", NULL },
 # define VM_INDEX			12
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_INDEX_INT			13
-    { Int, "(i8*)" },
+    { Int, "(i8*)", NULL },
 # define VM_INDEX2			14
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_INDEX2_INT			15
-    { Int, "(i8*)" },
+    { Int, "(i8*)", NULL },
 # define VM_AGGREGATE			16
-    { "void", "(i8*, i16)" },
+    { "void", "(i8*, i16)", NULL },
 # define VM_MAP_AGGREGATE		17
-    { "void", "(i8*, i16)" },
+    { "void", "(i8*, i16)", NULL },
 # define VM_CAST			18
-    { "void", "(i8*, i8, i16, i16)" },
+    { "void", "(i8*, i8, i16, i16)", NULL },
 # define VM_CAST_INT			19
-    { Int, "(i8*)" },
+    { Int, "(i8*)", NULL },
 # define VM_CAST_FLOAT			20
-    { Double, "(i8*)" },
+    { Double, "(i8*)", NULL },
 # define VM_INSTANCEOF			21
-    { Int, "(i8*, i16, i16)" },
+    { Int, "(i8*, i16, i16)", NULL },
 # define VM_RANGE			22
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_RANGE_FROM			23
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_RANGE_TO			24
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_STORE_PARAM			25
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORE_PARAM_INT		26
-    { "void", "(i8*, i8, " Int ")" },
+    { "void", "(i8*, i8, " Int ")", NULL },
 # define VM_STORE_PARAM_FLOAT		27
-    { "void", "(i8*, i8, " Double ")" },
+    { "void", "(i8*, i8, " Double ")", NULL },
 # define VM_STORE_LOCAL			28
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORE_LOCAL_INT		29
-    { "void", "(i8*, i8, " Int ")" },
+    { "void", "(i8*, i8, " Int ")", NULL },
 # define VM_STORE_LOCAL_FLOAT		30
-    { "void", "(i8*, i8, " Double ")" },
+    { "void", "(i8*, i8, " Double ")", NULL },
 # define VM_STORE_GLOBAL		31
-    { "void", "(i8*, i16, i8)" },
+    { "void", "(i8*, i16, i8)", NULL },
 # define VM_STORE_GLOBAL_INT		32
-    { "void", "(i8*, i16, i8, " Int ")" },
+    { "void", "(i8*, i16, i8, " Int ")", NULL },
 # define VM_STORE_GLOBAL_FLOAT		33
-    { "void", "(i8*, i16, i8, " Double ")" },
+    { "void", "(i8*, i16, i8, " Double ")", NULL },
 # define VM_STORE_INDEX			34
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_STORE_PARAM_INDEX		35
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORE_LOCAL_INDEX		36
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORE_GLOBAL_INDEX		37
-    { "void", "(i8*, i16, i8)" },
+    { "void", "(i8*, i16, i8)", NULL },
 # define VM_STORE_INDEX_INDEX		38
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_STORES			39
-    { "void", "(i8*, i16)" },
+    { "void", "(i8*, i16)", NULL },
 # define VM_STORES_LVAL			40
-    { "void", "(i8*, i16)" },
+    { "void", "(i8*, i16)", NULL },
 # define VM_STORES_SPREAD		41
-    { "void", "(i8*, i16, i8, i8, i16, i16)" },
+    { "void", "(i8*, i16, i8, i8, i16, i16)", NULL },
 # define VM_STORES_CAST			42
-    { "void", "(i8*, i8, i16, i16)" },
+    { "void", "(i8*, i8, i16, i16)", NULL },
 # define VM_STORES_PARAM		43
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORES_PARAM_INT		44
-    { Int, "(i8*, i8)" },
+    { Int, "(i8*, i8)", NULL },
 # define VM_STORES_PARAM_FLOAT		45
-    { Double, "(i8*, i8)" },
+    { Double, "(i8*, i8)", NULL },
 # define VM_STORES_LOCAL		46
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORES_LOCAL_INT		47
-    { Int, "(i8*, i8, " Int ")" },
+    { Int, "(i8*, i8, " Int ")", NULL },
 # define VM_STORES_LOCAL_FLOAT		48
-    { Double, "(i8*, i8, " Double ")" },
+    { Double, "(i8*, i8, " Double ")", NULL },
 # define VM_STORES_GLOBAL		49
-    { "void", "(i8*, i16, i8)" },
+    { "void", "(i8*, i16, i8)", NULL },
 # define VM_STORES_INDEX		50
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_STORES_PARAM_INDEX		51
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORES_LOCAL_INDEX		52
-    { "void", "(i8*, i8)" },
+    { "void", "(i8*, i8)", NULL },
 # define VM_STORES_GLOBAL_INDEX		53
-    { "void", "(i8*, i16, i8)" },
+    { "void", "(i8*, i16, i8)", NULL },
 # define VM_STORES_INDEX_INDEX		54
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_DIV_INT			55
-    { Int, "(i8*, " Int ", " Int ")" },
+    { Int, "(i8*, " Int ", " Int ")", NULL },
 # define VM_LSHIFT_INT			56
-    { Int, "(i8*, " Int ", " Int ")" },
+    { Int, "(i8*, " Int ", " Int ")", NULL },
 # define VM_MOD_INT			57
-    { Int, "(i8*, " Int ", " Int ")" },
+    { Int, "(i8*, " Int ", " Int ")", NULL },
 # define VM_RSHIFT_INT			58
-    { Int, "(i8*, " Int ", " Int ")" },
+    { Int, "(i8*, " Int ", " Int ")", NULL },
 # define VM_TOFLOAT			59
-    { Double, "(i8*)" },
+    { Double, "(i8*)", NULL },
 # define VM_TOINT			60
-    { Int, "(i8*)" },
+    { Int, "(i8*)", NULL },
 # define VM_TOINT_FLOAT			61
-    { Int, "(i8*, " Double ")" },
+    { Int, "(i8*, " Double ")", NULL },
 # define VM_NIL				62
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_ADD_FLOAT			63
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_DIV_FLOAT			64
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_MULT_FLOAT			65
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_SUB_FLOAT			66
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_KFUNC			67
-    { "void", "(i8*, i16, i32)" },
+    { "void", "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_INT			68
-    { Int, "(i8*, i16, i32)" },
+    { Int, "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_FLOAT			69
-    { Double, "(i8*, i16, i32)" },
+    { Double, "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_SPREAD		70
-    { "void", "(i8*, i16, i32)" },
+    { "void", "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_SPREAD_INT		71
-    { Int, "(i8*, i16, i32)" },
+    { Int, "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_SPREAD_FLOAT		72
-    { Double, "(i8*, i16, i32)" },
+    { Double, "(i8*, i16, i32)", NULL },
 # define VM_KFUNC_SPREAD_LVAL		73
-    { "void", "(i8*, i16, i16, i32)" },
+    { "void", "(i8*, i16, i16, i32)", NULL },
 # define VM_DFUNC			74
-    { "void", "(i8*, i16, i8, i32)" },
+    { "void", "(i8*, i16, i8, i32)", NULL },
 # define VM_DFUNC_INT			75
-    { Int, "(i8*, i16, i8, i32)" },
+    { Int, "(i8*, i16, i8, i32)", NULL },
 # define VM_DFUNC_FLOAT			76
-    { Double, "(i8*, i16, i8, i32)" },
+    { Double, "(i8*, i16, i8, i32)", NULL },
 # define VM_DFUNC_SPREAD		77
-    { "void", "(i8*, i16, i8, i32)" },
+    { "void", "(i8*, i16, i8, i32)", NULL },
 # define VM_DFUNC_SPREAD_INT		78
-    { Int, "(i8*, i16, i8, i32)" },
+    { Int, "(i8*, i16, i8, i32)", NULL },
 # define VM_DFUNC_SPREAD_FLOAT		79
-    { Double, "(i8*, i16, i8, i32)" },
+    { Double, "(i8*, i16, i8, i32)", NULL },
 # define VM_FUNC			80
-    { "void", "(i8*, i16, i32)" },
+    { "void", "(i8*, i16, i32)", NULL },
 # define VM_FUNC_SPREAD			81
-    { "void", "(i8*, i16, i32)" },
+    { "void", "(i8*, i16, i32)", NULL },
 # define VM_POP				82
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_POP_BOOL			83
-    { "i1", "(i8*)" },
+    { "i1", "(i8*)", NULL },
 # define VM_POP_INT			84
-    { Int, "(i8*)" },
+    { Int, "(i8*)", NULL },
 # define VM_POP_FLOAT			85
-    { Double, "(i8*)" },
+    { Double, "(i8*)", NULL },
 # define VM_SWITCH_INT			86
-    { "i1", "(i8*)" },
+    { "i1", "(i8*)", NULL },
 # define VM_SWITCH_RANGE		87
-    { "i32", "(" Int "*, i32, " Int ")" },
+    { "i32", "(" Int "*, i32, " Int ")", NULL },
 # define VM_SWITCH_STRING		88
-    { "i32", "(i8*, i16*, i32)" },
+    { "i32", "(i8*, i16*, i32)", NULL },
 # define VM_RLIMITS			89
-    { "void", "(i8*, i1)" },
+    { "void", "(i8*, i1)", NULL },
 # define VM_RLIMITS_END			90
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_CATCH			91
-    { "i8*", "(i8*)" },
+    { "i8*", "(i8*)", NULL },
 # define VM_CAUGHT			92
-    { "void", "(i8*, i1)" },
+    { "void", "(i8*, i1)", NULL },
 # define VM_CATCH_END			93
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_LINE			94
-    { "void", "(i8*, i16)" },
+    { "void", "(i8*, i16)", NULL },
 # define VM_LOOP_TICKS			95
-    { "void", "(i8*)" },
+    { "void", "(i8*)", NULL },
 # define VM_FABS			96
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_FLOOR			97
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_CEIL			98
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_FMOD			99
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_LDEXP			100
-    { Double, "(i8*, " Double ", " Int ")" },
+    { Double, "(i8*, " Double ", " Int ")", NULL },
 # define VM_EXP				101
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_LOG				102
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_LOG10			103
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_POW				104
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_SQRT			105
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_COS				106
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_SIN				107
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_TAN				108
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_ACOS			109
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_ASIN			110
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_ATAN			111
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_ATAN2			112
-    { Double, "(i8*, " Double ", " Double ")" },
+    { Double, "(i8*, " Double ", " Double ")", NULL },
 # define VM_COSH			113
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_SINH			114
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_TANH			115
-    { Double, "(i8*, " Double ")" },
+    { Double, "(i8*, " Double ")", NULL },
 # define VM_FUNCTIONS			116
 };
 
 class GenContext : public FlowContext {
 public:
     GenContext(FILE *stream, CodeFunction *func, StackSize size, int num,
-	       int flags) :
-	FlowContext(func, size), stream(stream), num(num), flags(flags) {
+	       int flags, int branch, uint64_t *profile, int profileSize) :
+	FlowContext(func, size), stream(stream), num(num), flags(flags),
+	branch(branch), profile(profile), profileSize(profileSize) {
 	next = 0;
 	line = 0;
 	switchList = NULL;
 	count = 0;
+	memset(used, false, sizeof(used));
     }
 
     virtual ~GenContext() { }
@@ -296,6 +313,7 @@ public:
      */
     void prepareGen(class Block *b) {
 	block = b;
+	nSplit = 0;
 	if (b->nTo != 0) {
 	    next = b->to[0]->first->addr;
 	}
@@ -370,60 +388,98 @@ public:
     }
 
     /*
-     * load a function address
+     * reference a function address, loaded at function entry
      */
     char *load(int func) {
-	char *ref;
+	static char buf[8];
 
-	ref = genRef();
-	fprintf(stream,
-		"\t%sg = getelementptr inbounds "
+	used[func] = true;
+	sprintf(buf, "%%vm%d", func);
+	return buf;
+    }
+
+    /*
+     * load the addresses of the functions used, once; the function table
+     * does not change while the function runs, so the loads are invariant
+     * and can be moved freely
+     */
+    void loadFunctions() {
+	int func;
+
+	fprintf(stream, "Lvm:\n");
+	for (func = 0; func <= VM_FUNCTIONS; func++) {
+	    if (used[func]) {
+		fprintf(stream,
+			"\t%%vm%dg = getelementptr inbounds "
 # ifndef LLVM3_6
-						"i8*, "
+							"i8*, "
 # endif
-						      "i8** %%vmtab, i32 %d\n",
-		ref, func);
-	fprintf(stream, "\t%sl = load "
+			"i8** %%vmtab, i32 %d\n", func, func);
+		fprintf(stream, "\t%%vm%dl = load "
 # ifndef LLVM3_6
-				      "i8*, "
+					       "i8*, "
 # endif
-					    "i8** %sg, align %d\n",
-		ref, ref, (int) sizeof(void *));
-	fprintf(stream, "\t%s = bitcast i8* %sl to %s %s*\n",
-		ref, ref, functions[func].ret, functions[func].args);
-	return ref;
+			"i8** %%vm%dg, align %d, !invariant.load !{}\n",
+			func, func, (int) sizeof(void *));
+		fprintf(stream, "\t%%vm%d = bitcast i8* %%vm%dl to %s %s*\n",
+			func, func, functions[func].ret, functions[func].args);
+	    }
+	}
+	fprintf(stream, "\tbr label %%Lparam\n");
     }
 
     /*
      * call VM function without arguments
      */
     void call(int func, char *ref) {
-	fprintf(stream, "\t%s = call %s %s(i8* %%f)\n", ref,
-		functions[func].ret, load(func));
+	fprintf(stream, "\t%s = call %s %s(i8* %%f) %s\n", ref,
+		functions[func].ret, load(func), attributes(func));
     }
 
     /*
-     * call VM function with arguments
+     * call VM function with arguments, to be completed with endCall()
      */
     void callArgs(int func, char *ref) {
 	fprintf(stream, "\t%s = call %s %s(i8* %%f, ", ref,
 		functions[func].ret, load(func));
+	calling = func;
     }
 
     /*
      * void call VM function without arguments
      */
     void voidCall(int func) {
-	fprintf(stream, "\tcall %s %s(i8* %%f)\n", functions[func].ret,
-		load(func));
+	fprintf(stream, "\tcall %s %s(i8* %%f) %s\n", functions[func].ret,
+		load(func), attributes(func));
     }
 
     /*
-     * void call VM function with arguments
+     * void call VM function with arguments, to be completed with endCall()
      */
     void voidCallArgs(int func) {
 	fprintf(stream, "\tcall %s %s(i8* %%f, ", functions[func].ret,
 		load(func));
+	calling = func;
+    }
+
+    /*
+     * emit the remaining arguments of a VM call, and its attributes
+     */
+    void endCall(const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	vfprintf(stream, format, args);
+	va_end(args);
+	fprintf(stream, ") %s\n", attributes(calling));
+    }
+
+    /*
+     * call attributes of a VM function
+     */
+    static const char *attributes(int func) {
+	return (functions[func].attributes != NULL) ?
+		functions[func].attributes : NOUNWIND;
     }
 
     /*
@@ -432,7 +488,7 @@ public:
     void updateLine(CodeLine line) {
 	if (this->line != line) {
 	    voidCallArgs(VM_LINE);
-	    fprintf(stream, "i16 %u)\n", line);
+	    endCall("i16 %u", line);
 	    this->line = line;
 	}
     }
@@ -445,6 +501,22 @@ public:
 		from->relayToDefault(to));
     }
 
+    /*
+     * label of a part of a block that has been split
+     */
+    static char *segment(Block *b, int n) {
+	static char buf[2][16];
+	static int i = 0;
+
+	i ^= 1;
+	if (n == 0) {
+	    sprintf(buf[i], "L%04x", b->first->addr);
+	} else {
+	    sprintf(buf[i], "L%04xS%d", b->first->addr, n);
+	}
+	return buf[i];
+    }
+
     /*
      * block exit label
      */
@@ -456,7 +528,7 @@ public:
 	} else if (from->relay()) {
 	    sprintf(buf, "L%04xS", from->first->addr);
 	} else {
-	    sprintf(buf, "L%04x", from->first->addr);
+	    return segment(from, ((ClangBlock *) from)->nSplits);
 	}
 
 	return buf;
@@ -469,6 +541,47 @@ public:
 	return label(block, to);
     }
 
+    /*
+     * split the current block, and return the label of the new part
+     */
+    char *split() {
+	return segment(block, ++nSplit);
+    }
+
+    /*
+     * branch to a cold path if cond holds, and update the line number only
+     * there
+     */
+    void coldPath(char *cond, CodeLine line) {
+	strcpy(hotLabel, segment(block, nSplit));
+	fprintf(stream, "\tbr i1 %s, label %%%s, ", cond,
+		segment(block, nSplit + 1));
+	fprintf(stream, "label %%%s, !prof !{"
+# ifdef LLVM3_6
+					     "metadata "
+# endif
+			"!\"branch_weights\", i32 1, i32 %d}\n",
+		segment(block, nSplit + 2), COLD_WEIGHT);
+	strcpy(coldLabel, split());
+	fprintf(stream, "%s:\n", coldLabel);
+	if (this->line != line) {
+	    voidCallArgs(VM_LINE);
+	    endCall("i16 %u", line);
+	}
+    }
+
+    /*
+     * return from a cold path, restoring the line number of the hot path
+     */
+    void endColdPath(CodeLine line) {
+	if (this->line != line && this->line != 0) {
+	    voidCallArgs(VM_LINE);
+	    endCall("i16 %u", this->line);
+	}
+	fprintf(stream, "\tbr label %%%s\n", segment(block, nSplit + 1));
+	fprintf(stream, "%s:\n", split());
+    }
+
     /*
      * default block target label
      */
@@ -498,6 +611,52 @@ public:
 	}
     }
 
+    /*
+     * count the outcome of a conditional branch when instrumenting, or
+     * return the weights of its outcomes when a profile is available
+     */
+    char *branchProfile(char *cond) {
+	static char buf[64];
+	uint64_t taken, notTaken, scale;
+	char *ref;
+	int b;
+
+	b = branch++;
+	buf[0] = '\0';
+	if (flags & JIT_PROFILE) {
+	    ref = genRef();
+	    fprintf(stream, "\t%si = zext i1 %s to i64\n", ref, cond);
+	    fprintf(stream,
+		    "\t%sg = getelementptr inbounds "
+# ifndef LLVM3_6
+						    "[2 x i64], "
+# endif
+		    "[2 x i64]* @b%d, i64 0, i64 %si\n", ref, b, ref);
+	    fprintf(stream, "\t%sl = load "
+# ifndef LLVM3_6
+					  "i64, "
+# endif
+		    "i64* %sg, align 8\n", ref, ref);
+	    fprintf(stream, "\t%s = add i64 %sl, 1\n", ref, ref);
+	    fprintf(stream, "\tstore i64 %s, i64* %sg, align 8\n", ref, ref);
+	} else if (2 * b + 1 < profileSize) {
+	    taken = profile[2 * b + 1];
+	    notTaken = profile[2 * b];
+	    if (taken != 0 || notTaken != 0) {
+		scale = ((taken > notTaken) ? taken : notTaken);
+		scale = scale / UINT32_MAX + 1;
+		sprintf(buf, ", !prof !{"
+# ifdef LLVM3_6
+				       "metadata "
+# endif
+			"!\"branch_weights\", i32 %u, i32 %u}",
+			(unsigned) (taken / scale),
+			(unsigned) (notTaken / scale));
+	    }
+	}
+	return buf;
+    }
+
     /*
      * store local variables that will be modified
      */
@@ -509,13 +668,13 @@ public:
 		switch (block->localType(n)) {
 		case LPC_TYPE_INT:
 		    voidCallArgs(VM_STORE_LOCAL_INT);
-		    fprintf(stream, "i8 %u, " Int " %s)\n", n + 1,
+		    endCall("i8 %u, " Int " %s", n + 1,
 			    ClangCode::localRef(n, block->localOut(n)));
 		    break;
 
 		case LPC_TYPE_FLOAT:
 		    voidCallArgs(VM_STORE_LOCAL_FLOAT);
-		    fprintf(stream, "i8 %u, " Double " %s)\n", n + 1,
+		    endCall("i8 %u, " Double " %s", n + 1,
 			    ClangCode::localRef(n, block->localOut(n)));
 		    break;
 		}
@@ -537,7 +696,7 @@ public:
 		    for (i = 0; i < b->nTo; i++) {
 			if (b->to[i]->mergedLocalType(n) == LPC_TYPE_MIXED) {
 			    voidCallArgs(VM_STORE_LOCAL_INT);
-			    fprintf(stream, "i8 %u, " Int " %s)\n", n + 1,
+			    endCall("i8 %u, " Int " %s", n + 1,
 				    ClangCode::localRef(n, b->localOut(n)));
 			    break;
 			}
@@ -548,7 +707,7 @@ public:
 		    for (i = 0; i < b->nTo; i++) {
 			if (b->to[i]->mergedLocalType(n) == LPC_TYPE_MIXED) {
 			    voidCallArgs(VM_STORE_LOCAL_FLOAT);
-			    fprintf(stream, "i8 %u, " Double " %s)\n", n + 1,
+			    endCall("i8 %u, " Double " %s", n + 1,
 				    ClangCode::localRef(n, b->localOut(n)));
 			    break;
 			}
@@ -563,11 +722,19 @@ public:
     int num;			/* function number */
     CodeSize next;		/* address of next block */
     ClangCode *switchList;	/* list of switch tables */
+    char hotLabel[16];		/* hot path before the last cold path */
+    char coldLabel[16];		/* last cold path */
+    int nSplit;			/* current part of split block */
     int flags;			/* jitcomp flags */
+    int branch;			/* index of next conditional branch */
+    uint64_t *profile;		/* branch counts, or NULL */
+    int profileSize;		/* # branch counts */
 
 private:
     CodeLine line;		/* current line number */
     int count;			/* reference counter */
+    int calling;		/* VM function being called */
+    bool used[VM_FUNCTIONS + 1]; /* functions used */
 };
 
 
@@ -705,10 +872,10 @@ void ClangCode::pushResult(GenContext *context)
     if (!pop && offStack(context, sp) == LPC_TYPE_NIL) {
 	if (context->get(sp).type == LPC_TYPE_INT) {
 	    context->voidCallArgs(VM_INT);
-	    fprintf(context->stream, Int " %s)\n", tmpRef(sp));
+	    context->endCall(Int " %s", tmpRef(sp));
 	} else {
 	    context->voidCallArgs(VM_FLOAT);
-	    fprintf(context->stream, Double " %s)\n", tmpRef(sp));
+	    context->endCall(Double " %s", tmpRef(sp));
 	}
     }
     context->sp = sp;
@@ -761,6 +928,46 @@ void ClangCode::popStores(GenContext *context, StackSize sp)
     }
 }
 
+/*
+ * perform an integer operation natively, leaving operands for which it
+ * would be undefined, or for which the VM raises an error, to the VM
+ * function on a cold path
+ */
+void ClangCode::checkedInt(GenContext *context, const char *op, int func,
+			   bool shift)
+{
+    char *ref, *ref2;
+
+    ref = context->genRef();
+    if (shift) {
+	/* negative or too large */
+	fprintf(context->stream, "\t%s = icmp uge " Int " %s, %d\n", ref,
+		tmpRef(context->sp), INT_SIZE * 8);
+	fprintf(context->stream, "\t%ss = select i1 %s, " Int " 0, " Int
+				 " %s\n", ref, ref, tmpRef(context->sp));
+    } else {
+	/* 0, or -1 which may overflow */
+	fprintf(context->stream, "\t%sd = add " Int " %s, 1\n", ref,
+		tmpRef(context->sp));
+	fprintf(context->stream, "\t%s = icmp ult " Int " %sd, 2\n", ref, ref);
+	fprintf(context->stream, "\t%ss = select i1 %s, " Int " 1, " Int
+				 " %s\n", ref, ref, tmpRef(context->sp));
+    }
+    fprintf(context->stream, "\t%sr = %s " Int " %s, %ss\n", ref, op,
+	    tmpRef(context->nextSp(context->sp)), ref);
+
+    context->coldPath(ref, line);
+    ref2 = context->genRef();
+    context->callArgs(func, ref2);
+    context->endCall(Int " %s, " Int " %s",
+		     tmpRef(context->nextSp(context->sp)),
+		     tmpRef(context->sp));
+    context->endColdPath(line);
+    fprintf(context->stream, "\t%s = phi " Int " [%sr, %%%s], [%s, %%%s]\n",
+	    tmpRef(stackPointer()), ref, context->hotLabel, ref2,
+	    context->coldLabel);
+}
+
 /*
  * obtain the argument to an int/range switch, and branch to default when
  * it isn't an int
@@ -781,6 +988,102 @@ void ClangCode::switchInt(GenContext *context)
     }
 }
 
+/*
+ * count the values in the ranges of a range switch, up to a maximum
+ */
+int ClangCode::rangeCases(int max)
+{
+    uint64_t n;
+    int i;
+
+    n = 0;
+    for (i = 1; i < size; i++) {
+	n += (uint64_t) caseRange[i].to - (uint64_t) caseRange[i].from + 1;
+	if (n == 0 || n > (uint64_t) max) {
+	    return max + 1;
+	}
+    }
+    return (int) n;
+}
+
+/*
+ * load an entry from the range table
+ */
+void ClangCode::rangeEntry(GenContext *context, char *ref, char *index)
+{
+    fprintf(context->stream, "\t%sp = getelementptr inbounds "
+# ifndef LLVM3_6
+							  "[%d x " Int "], "
+# endif
+	    "[%d x " Int "]* @func%d.%04x, i32 0, i32 %s\n", ref,
+# ifndef LLVM3_6
+	    2 * (size - 1),
+# endif
+	    2 * (size - 1), context->num, addr, index);
+    fprintf(context->stream, "\t%se = load "
+# ifndef LLVM3_6
+					   Int ", "
+# endif
+	    Int "* %sp, align %d\n", ref, ref, INT_SIZE);
+}
+
+/*
+ * find the index of the range that the switch argument is in, or -1, with
+ * a binary search without branches
+ */
+char *ClangCode::rangeIndex(GenContext *context)
+{
+    static char buf[16];
+    char base[16], index[16], *ref, *ref2;
+    int len, half;
+
+    /* find the last range that starts at or before the argument */
+    strcpy(base, "0");
+    for (len = size - 1; len > 1; len -= half) {
+	half = len / 2;
+	ref = context->genRef();
+	fprintf(context->stream, "\t%sk = add i32 %s, %d\n", ref, base, half);
+	fprintf(context->stream, "\t%si = shl i32 %sk, 1\n", ref, ref);
+	sprintf(index, "%si", ref);
+	rangeEntry(context, ref, index);
+	fprintf(context->stream, "\t%sc = icmp sle " Int " %se, %s\n", ref,
+		ref, tmpRef(context->sp));
+	fprintf(context->stream, "\t%s = select i1 %sc, i32 %sk, i32 %s\n",
+		ref, ref, ref, base);
+	strcpy(base, ref);
+    }
+    ref = context->genRef();
+    fprintf(context->stream, "\t%si = shl i32 %s, 1\n", ref, base);
+    sprintf(index, "%si", ref);
+    rangeEntry(context, ref, index);
+    fprintf(context->stream, "\t%sc = icmp sle " Int " %se, %s\n", ref, ref,
+	    tmpRef(context->sp));
+    fprintf(context->stream, "\t%sm = sub i32 %s, 1\n", ref, base);
+    fprintf(context->stream, "\t%sj = select i1 %sc, i32 %s, i32 %sm\n", ref,
+	    ref, base, ref);
+
+    /* check that the argument is within that range */
+    fprintf(context->stream, "\t%sn = icmp slt i32 %sj, 0\n", ref, ref);
+    fprintf(context->stream, "\t%sa = select i1 %sn, i32 0, i32 %sj\n", ref,
+	    ref, ref);
+    fprintf(context->stream, "\t%st = shl i32 %sa, 1\n", ref, ref);
+    fprintf(context->stream, "\t%su = or i32 %st, 1\n", ref, ref);
+    ref2 = context->genRef();
+    sprintf(index, "%su", ref);
+    rangeEntry(context, ref2, index);
+    fprintf(context->stream, "\t%sc = icmp sle " Int " %s, %se\n", ref2,
+	    tmpRef(context->sp), ref2);
+    fprintf(context->stream, "\t%s = select i1 %sc, i32 %sj, i32 -1\n", ref2,
+	    ref2, ref);
+
+    /* the range table is generated with the function */
+    list = context->switchList;
+    context->switchList = this;
+
+    strcpy(buf, ref2);
+    return buf;
+}
+
 /*
  * reference a switch table, to be generated
  */
@@ -808,7 +1111,8 @@ void ClangCode::emit(GenContext *context)
 {
     StackSize sp;
     long double d;
-    char *ref, *ref2;
+    char *ref, *ref2, *weights;
+    LPCInt n;
     int i;
 
     sp = stackPointer();
@@ -837,7 +1141,7 @@ void ClangCode::emit(GenContext *context)
 
     case STRING:
 	context->voidCallArgs(VM_STRING);
-	fprintf(context->stream, "i16 %u, i16 %u)\n", str.inherit, str.index);
+	context->endCall("i16 %u, i16 %u", str.inherit, str.index);
 	break;
 
     case PARAM:
@@ -856,17 +1160,17 @@ void ClangCode::emit(GenContext *context)
 	    switch (offStack(context, sp)) {
 	    case LPC_TYPE_INT:
 		context->callArgs(VM_PARAM_INT, tmpRef(sp));
-		fprintf(context->stream, "i8 %u)\n", param);
+		context->endCall("i8 %u", param);
 		break;
 
 	    case LPC_TYPE_FLOAT:
 		context->callArgs(VM_PARAM_FLOAT, tmpRef(sp));
-		fprintf(context->stream, "i8 %u)\n", param);
+		context->endCall("i8 %u", param);
 		break;
 
 	    default:
 		context->voidCallArgs(VM_PARAM);
-		fprintf(context->stream, "i8 %u)\n", param);
+		context->endCall("i8 %u", param);
 		break;
 	    }
 	    break;
@@ -889,17 +1193,17 @@ void ClangCode::emit(GenContext *context)
 	    switch (offStack(context, sp)) {
 	    case LPC_TYPE_INT:
 		context->callArgs(VM_LOCAL_INT, tmpRef(sp));
-		fprintf(context->stream, "i8 %u)\n", local + 1);
+		context->endCall("i8 %u", local + 1);
 		break;
 
 	    case LPC_TYPE_FLOAT:
 		context->callArgs(VM_LOCAL_FLOAT, tmpRef(sp));
-		fprintf(context->stream, "i8 %u)\n", local + 1);
+		context->endCall("i8 %u", local + 1);
 		break;
 
 	    default:
 		context->voidCallArgs(VM_LOCAL);
-		fprintf(context->stream, "i8 %u)\n", local + 1);
+		context->endCall("i8 %u", local + 1);
 		break;
 	    }
 	    break;
@@ -910,22 +1214,19 @@ void ClangCode::emit(GenContext *context)
 	switch (offStack(context, sp)) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_GLOBAL_INT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit,
-		    var.index);
+	    context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	    pushResult(context);
 	    return;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_GLOBAL_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit,
-		    var.index);
+	    context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	    pushResult(context);
 	    return;
 
 	default:
 	    context->voidCallArgs(VM_GLOBAL);
-	    fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit,
-		    var.index);
+	    context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	    break;
 	}
 	break;
@@ -952,13 +1253,13 @@ void ClangCode::emit(GenContext *context)
 
     case AGGREGATE:
 	context->voidCallArgs(VM_AGGREGATE);
-	fprintf(context->stream, "i16 %u)\n", size);
+	context->endCall("i16 %u", size);
 	break;
 
     case MAP_AGGREGATE:
 	context->updateLine(line);
 	context->voidCallArgs(VM_MAP_AGGREGATE);
-	fprintf(context->stream, "i16 %u)\n", size);
+	context->endCall("i16 %u", size);
 	break;
 
     case CAST:
@@ -976,13 +1277,13 @@ void ClangCode::emit(GenContext *context)
 
 	case LPC_TYPE_CLASS:
 	    context->voidCallArgs(VM_CAST);
-	    fprintf(context->stream, "i8 %u, i16 %u, i16 %u)\n", type.type,
-		    type.inherit, type.index);
+	    context->endCall("i8 %u, i16 %u, i16 %u", type.type, type.inherit,
+			     type.index);
 	    break;
 
 	default:
 	    context->voidCallArgs(VM_CAST);
-	    fprintf(context->stream, "i8 %u, i16 0, i16 0)\n", type.type);
+	    context->endCall("i8 %u, i16 0, i16 0", type.type);
 	    break;
 	}
 	break;
@@ -990,7 +1291,7 @@ void ClangCode::emit(GenContext *context)
     case INSTANCEOF:
 	context->updateLine(line);
 	context->callArgs(VM_INSTANCEOF, tmpRef(sp));
-	fprintf(context->stream, "i16 %u, i16 %u)\n", str.inherit, str.index);
+	context->endCall("i16 %u, i16 %u", str.inherit, str.index);
 	pushResult(context);
 	return;
 
@@ -1014,8 +1315,7 @@ void ClangCode::emit(GenContext *context)
 	case LPC_TYPE_INT:
 	    context->copyInt(paramRef(context, param), tmpRef(context->sp));
 	    context->voidCallArgs(VM_STORE_PARAM_INT);
-	    fprintf(context->stream, "i8 %u, " Int " %s)\n", param,
-		    tmpRef(context->sp));
+	    context->endCall("i8 %u, " Int " %s", param, tmpRef(context->sp));
 	    if (!pop) {
 		context->copyInt(tmpRef(sp), tmpRef(context->sp));
 	    }
@@ -1025,8 +1325,8 @@ void ClangCode::emit(GenContext *context)
 	case LPC_TYPE_FLOAT:
 	    context->copyFloat(paramRef(context, param), tmpRef(context->sp));
 	    context->voidCallArgs(VM_STORE_PARAM_FLOAT);
-	    fprintf(context->stream, "i8 %u, " Double " %s)\n", param,
-		    tmpRef(context->sp));
+	    context->endCall("i8 %u, " Double " %s", param,
+			     tmpRef(context->sp));
 	    if (!pop) {
 		context->copyFloat(tmpRef(sp), tmpRef(context->sp));
 	    }
@@ -1035,7 +1335,7 @@ void ClangCode::emit(GenContext *context)
 
 	default:
 	    context->voidCallArgs(VM_STORE_PARAM);
-	    fprintf(context->stream, "i8 %u)\n", param);
+	    context->endCall("i8 %u", param);
 	    popResult(context);
 	    return;
 	}
@@ -1046,8 +1346,8 @@ void ClangCode::emit(GenContext *context)
 	    context->copyInt(localRef(context, local), tmpRef(context->sp));
 	    if (context->caught != NULL) {
 		context->voidCallArgs(VM_STORE_LOCAL_INT);
-		fprintf(context->stream, "i8 %u, " Int " %s)\n", local + 1,
-			tmpRef(context->sp));
+		context->endCall("i8 %u, " Int " %s", local + 1,
+				 tmpRef(context->sp));
 	    }
 	    if (!pop) {
 		context->copyInt(tmpRef(sp), tmpRef(context->sp));
@@ -1059,8 +1359,8 @@ void ClangCode::emit(GenContext *context)
 	    context->copyFloat(localRef(context, local), tmpRef(context->sp));
 	    if (context->caught != NULL) {
 		context->voidCallArgs(VM_STORE_LOCAL_FLOAT);
-		fprintf(context->stream, "i8 %u, " Double " %s)\n", local + 1,
-			tmpRef(context->sp));
+		context->endCall("i8 %u, " Double " %s", local + 1,
+				 tmpRef(context->sp));
 	    }
 	    if (!pop) {
 		context->copyFloat(tmpRef(sp), tmpRef(context->sp));
@@ -1070,7 +1370,7 @@ void ClangCode::emit(GenContext *context)
 
 	default:
 	    context->voidCallArgs(VM_STORE_LOCAL);
-	    fprintf(context->stream, "i8 %u)\n", local + 1);
+	    context->endCall("i8 %u", local + 1);
 	    popResult(context);
 	    return;
 	}
@@ -1079,8 +1379,8 @@ void ClangCode::emit(GenContext *context)
 	switch (context->get(context->sp).type) {
 	case LPC_TYPE_INT:
 	    context->voidCallArgs(VM_STORE_GLOBAL_INT);
-	    fprintf(context->stream, "i16 %u, i8 %u, " Int " %s)\n",
-		    var.inherit, var.index, tmpRef(context->sp));
+	    context->endCall("i16 %u, i8 %u, " Int " %s", var.inherit,
+			     var.index, tmpRef(context->sp));
 	    if (!pop) {
 		context->copyInt(tmpRef(sp), tmpRef(context->sp));
 	    }
@@ -1089,8 +1389,8 @@ void ClangCode::emit(GenContext *context)
 
 	case LPC_TYPE_FLOAT:
 	    context->voidCallArgs(VM_STORE_GLOBAL_FLOAT);
-	    fprintf(context->stream, "i16 %u, i8 %u, " Double " %s)\n",
-		    var.inherit, var.index, tmpRef(context->sp));
+	    context->endCall("i16 %u, i8 %u, " Double " %s", var.inherit,
+			     var.index, tmpRef(context->sp));
 	    if (!pop) {
 		context->copyFloat(tmpRef(sp), tmpRef(context->sp));
 	    }
@@ -1099,8 +1399,7 @@ void ClangCode::emit(GenContext *context)
 
 	default:
 	    context->voidCallArgs(VM_STORE_GLOBAL);
-	    fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit,
-		    var.index);
+	    context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	    popResult(context);
 	    return;
 	}
@@ -1114,21 +1413,21 @@ void ClangCode::emit(GenContext *context)
     case STORE_PARAM_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORE_PARAM_INDEX);
-	fprintf(context->stream, "i8 %u)\n", param);
+	context->endCall("i8 %u", param);
 	popResult(context);
 	return;
 
     case STORE_LOCAL_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORE_LOCAL_INDEX);
-	fprintf(context->stream, "i8 %u)\n", local + 1);
+	context->endCall("i8 %u", local + 1);
 	popResult(context);
 	return;
 
     case STORE_GLOBAL_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORE_GLOBAL_INDEX);
-	fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit, var.index);
+	context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	popResult(context);
 	return;
 
@@ -1142,7 +1441,7 @@ void ClangCode::emit(GenContext *context)
 	if (context->stores(size, (pop) ? this : NULL, false)) {
 	    context->updateLine(line);
 	    context->voidCallArgs(VM_STORES);
-	    fprintf(context->stream, "i16 %u)\n", size);
+	    context->endCall("i16 %u", size);
 	} else {
 	    popStores(context, sp);
 	}
@@ -1157,7 +1456,7 @@ void ClangCode::emit(GenContext *context)
 		fprintf(context->stream, "i16 %u, ", size);
 	    } else {
 		context->voidCallArgs(VM_STORES_LVAL);
-		fprintf(context->stream, "i16 %u)\n", size);
+		context->endCall("i16 %u", size);
 	    }
 	} else {
 	    popStores(context, sp);
@@ -1167,11 +1466,10 @@ void ClangCode::emit(GenContext *context)
 
     case STORES_SPREAD:
 	if (type.type == LPC_TYPE_CLASS) {
-	    fprintf(context->stream, "i8 %u, i8 %u, i16 %u, i16 %u)\n",
-		    spread, type.type, type.inherit, type.index);
+	    context->endCall("i8 %u, i8 %u, i16 %u, i16 %u", spread, type.type,
+			     type.inherit, type.index);
 	} else {
-	    fprintf(context->stream, "i8 %u, i8 %u, i16 0, i16 0)\n", spread,
-		    type.type);
+	    context->endCall("i8 %u, i8 %u, i16 0, i16 0", spread, type.type);
 	}
 	if (!context->storeN()) {
 	    popStores(context, sp);
@@ -1182,10 +1480,10 @@ void ClangCode::emit(GenContext *context)
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORES_CAST);
 	if (type.type == LPC_TYPE_CLASS) {
-	    fprintf(context->stream, "i8 %u, i16 %u, i16 %u)\n", type.type,
-		    type.inherit, type.index);
+	    context->endCall("i8 %u, i16 %u, i16 %u", type.type, type.inherit,
+			     type.index);
 	} else {
-	    fprintf(context->stream, "i8 %u, i16 0, i16 0)\n", type.type);
+	    context->endCall("i8 %u, i16 0, i16 0", type.type);
 	}
 	break;
 
@@ -1193,17 +1491,17 @@ void ClangCode::emit(GenContext *context)
 	switch (varType) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_STORES_PARAM_INT, paramRef(context, param));
-	    fprintf(context->stream, "i8 %u)\n", param);
+	    context->endCall("i8 %u", param);
 	    break;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_STORES_PARAM_FLOAT, paramRef(context, param));
-	    fprintf(context->stream, "i8 %u)\n", param);
+	    context->endCall("i8 %u", param);
 	    break;
 
 	default:
 	    context->voidCallArgs(VM_STORES_PARAM);
-	    fprintf(context->stream, "i8 %u)\n", param);
+	    context->endCall("i8 %u", param);
 	    break;
 	}
 	if (!context->storeN()) {
@@ -1215,20 +1513,22 @@ void ClangCode::emit(GenContext *context)
 	switch (varType) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_STORES_LOCAL_INT, localRef(context, local));
-	    fprintf(context->stream, "i8 %u, " Int " %s)\n", local + 1,
-		    (context->lval()) ? localPre(context, local) : "0");
+	    context->endCall("i8 %u, " Int " %s", local + 1,
+			     (context->lval()) ?
+			      localPre(context, local) : "0");
 	    break;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_STORES_LOCAL_FLOAT, localRef(context, local));
-	    fprintf(context->stream, "i8 %u, " Double " %s)\n", local + 1,
-		    (context->lval()) ?
-		     localPre(context, local) : context->genFloat(0.0L));
+	    context->endCall("i8 %u, " Double " %s", local + 1,
+			     (context->lval()) ?
+			      localPre(context, local) :
+			      context->genFloat(0.0L));
 	    break;
 
 	default:
 	    context->voidCallArgs(VM_STORES_LOCAL);
-	    fprintf(context->stream, "i8 %u)\n", local + 1);
+	    context->endCall("i8 %u", local + 1);
 	    break;
 	}
 	if (!context->storeN()) {
@@ -1238,7 +1538,7 @@ void ClangCode::emit(GenContext *context)
 
     case STORES_GLOBAL:
 	context->voidCallArgs(VM_STORES_GLOBAL);
-	fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit, var.index);
+	context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	if (!context->storeN()) {
 	    popStores(context, sp);
 	}
@@ -1255,7 +1555,7 @@ void ClangCode::emit(GenContext *context)
     case STORES_PARAM_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORES_PARAM_INDEX);
-	fprintf(context->stream, "i8 %u)\n", param);
+	context->endCall("i8 %u", param);
 	if (!context->storeN()) {
 	    popStores(context, sp);
 	}
@@ -1264,7 +1564,7 @@ void ClangCode::emit(GenContext *context)
     case STORES_LOCAL_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORES_LOCAL_INDEX);
-	fprintf(context->stream, "i8 %u)\n", local + 1);
+	context->endCall("i8 %u", local + 1);
 	if (!context->storeN()) {
 	    popStores(context, sp);
 	}
@@ -1273,7 +1573,7 @@ void ClangCode::emit(GenContext *context)
     case STORES_GLOBAL_INDEX:
 	context->updateLine(line);
 	context->voidCallArgs(VM_STORES_GLOBAL_INDEX);
-	fprintf(context->stream, "i16 %u, i8 %u)\n", var.inherit, var.index);
+	context->endCall("i16 %u, i8 %u", var.inherit, var.index);
 	if (!context->storeN()) {
 	    popStores(context, sp);
 	}
@@ -1298,8 +1598,10 @@ void ClangCode::emit(GenContext *context)
 	} else {
 	    context->call(VM_POP_BOOL, ref);
 	}
-	fprintf(context->stream, "\tbr i1 %s, label %%L%04x, label %%%s\n",
-		ref, context->next, context->target(context->block->to[1]));
+	weights = context->branchProfile(ref);
+	fprintf(context->stream, "\tbr i1 %s, label %%L%04x, label %%%s%s\n",
+		ref, context->next, context->target(context->block->to[1]),
+		weights);
 	context->jumpRelay(line, context->block->to[1]);
 	context->sp = sp;
 	return;
@@ -1312,8 +1614,10 @@ void ClangCode::emit(GenContext *context)
 	} else {
 	    context->call(VM_POP_BOOL, ref);
 	}
-	fprintf(context->stream, "\tbr i1 %s, label %%%s, label %%L%04x\n",
-		ref, context->target(context->block->to[1]), context->next);
+	weights = context->branchProfile(ref);
+	fprintf(context->stream, "\tbr i1 %s, label %%%s, label %%L%04x%s\n",
+		ref, context->target(context->block->to[1]), context->next,
+		weights);
 	context->jumpRelay(line, context->block->to[1]);
 	context->sp = sp;
 	return;
@@ -1342,14 +1646,27 @@ void ClangCode::emit(GenContext *context)
 
     case SWITCH_RANGE:
 	switchInt(context);
-	if (size > 1) {
-	    ref = context->genRef();
-	    fprintf(context->stream, "\t%s = call i32 %s(", ref,
-		    context->load(VM_SWITCH_RANGE));
-	    genTable(context, Int);
-	    fprintf(context->stream,
-		    ", " Int " %s)\n\tswitch i32 %s, label %%%s [\n",
-		    tmpRef(context->sp), ref,
+	if (size > 1 && rangeCases(RANGE_CASES) <= RANGE_CASES) {
+	    /*
+	     * expand the ranges into a switch, so a jump table can be used
+	     */
+	    fprintf(context->stream, "\tswitch " Int " %s, label %%%s [\n",
+		    tmpRef(context->sp),
+		    context->target(context->block->to[0]));
+	    for (i = 1; i < size; i++) {
+		ref = context->target(context->block->to[i]);
+		for (n = caseRange[i].from; ; n++) {
+		    fprintf(context->stream, "\t\t" Int " %lld, label %%%s\n",
+			    (long long) n, ref);
+		    if (n == caseRange[i].to) {
+			break;
+		    }
+		}
+	    }
+	    fprintf(context->stream, "\t]\n");
+	} else if (size > 1) {
+	    ref = rangeIndex(context);
+	    fprintf(context->stream, "\tswitch i32 %s, label %%%s [\n", ref,
 		    context->target(context->block->to[0]));
 	    for (i = 1; i < size; i++) {
 		fprintf(context->stream, "\t\ti32 %d, label %%%s\n", i - 1,
@@ -1412,10 +1729,7 @@ void ClangCode::emit(GenContext *context)
 	    return;
 
 	case KF_DIV_INT:
-	    context->updateLine(line);
-	    context->callArgs(VM_DIV_INT, tmpRef(sp));
-	    fprintf(context->stream, Int " %s, " Int " %s)\n",
-		    tmpRef(context->nextSp(context->sp)), tmpRef(context->sp));
+	    checkedInt(context, "sdiv", VM_DIV_INT, false);
 	    pushResult(context);
 	    return;
 
@@ -1456,11 +1770,7 @@ void ClangCode::emit(GenContext *context)
 	    return;
 
 	case KF_LSHIFT_INT:
-	    context->updateLine(line);
-	    context->callArgs(VM_LSHIFT_INT, tmpRef(sp));
-	    fprintf(context->stream, Int " %s, " Int " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    checkedInt(context, "shl", VM_LSHIFT_INT, true);
 	    pushResult(context);
 	    return;
 
@@ -1474,11 +1784,7 @@ void ClangCode::emit(GenContext *context)
 	    return;
 
 	case KF_MOD_INT:
-	    context->updateLine(line);
-	    context->callArgs(VM_MOD_INT, tmpRef(sp));
-	    fprintf(context->stream, Int " %s, " Int " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    checkedInt(context, "srem", VM_MOD_INT, false);
 	    pushResult(context);
 	    return;
 
@@ -1523,9 +1829,9 @@ void ClangCode::emit(GenContext *context)
 	case KF_RSHIFT_INT:
 	    context->updateLine(line);
 	    context->callArgs(VM_RSHIFT_INT, tmpRef(sp));
-	    fprintf(context->stream, Int " %s, " Int " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Int " %s, " Int " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
@@ -1571,8 +1877,7 @@ void ClangCode::emit(GenContext *context)
 	    case LPC_TYPE_FLOAT:
 		context->updateLine(line);
 		context->callArgs(VM_TOINT_FLOAT, tmpRef(sp));
-		fprintf(context->stream, Double " %s)\n",
-			tmpRef(context->sp));
+		context->endCall(Double " %s", tmpRef(context->sp));
 		break;
 
 	    default:
@@ -1612,24 +1917,26 @@ void ClangCode::emit(GenContext *context)
 	case KF_ADD_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_ADD_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)), tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_ADD1_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_ADD_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->sp), context->genFloat(1.0L));
+	    context->endCall(Double " %s, " Double " %s", tmpRef(context->sp),
+			     context->genFloat(1.0L));
 	    pushResult(context);
 	    return;
 
 	case KF_DIV_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_DIV_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)), tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
@@ -1681,9 +1988,9 @@ void ClangCode::emit(GenContext *context)
 	case KF_MULT_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_MULT_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
@@ -1708,16 +2015,17 @@ void ClangCode::emit(GenContext *context)
 	case KF_SUB_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_SUB_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)), tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_SUB1_FLT:
 	    context->updateLine(line);
 	    context->callArgs(VM_SUB_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->sp), context->genFloat(1.0L));
+	    context->endCall(Double " %s, " Double " %s", tmpRef(context->sp),
+			     context->genFloat(1.0L));
 	    pushResult(context);
 	    return;
 
@@ -1738,28 +2046,28 @@ void ClangCode::emit(GenContext *context)
 
 	case KF_FABS:
 	    context->callArgs(VM_FABS, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_FLOOR:
 	    context->callArgs(VM_FLOOR, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_CEIL:
 	    context->callArgs(VM_CEIL, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_FMOD:
 	    context->updateLine(line);
 	    context->callArgs(VM_FMOD, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
@@ -1768,118 +2076,118 @@ void ClangCode::emit(GenContext *context)
 	    intArg(context, context->sp);
 	    floatArg(context, context->nextSp(context->sp));
 	    context->callArgs(VM_LDEXP, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Int " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Double " %s, " Int " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_EXP:
 	    context->updateLine(line);
 	    context->callArgs(VM_EXP, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_LOG:
 	    context->updateLine(line);
 	    context->callArgs(VM_LOG, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_LOG10:
 	    context->updateLine(line);
 	    context->callArgs(VM_LOG10, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_POW:
 	    context->updateLine(line);
 	    context->callArgs(VM_POW, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_SQRT:
 	    context->updateLine(line);
 	    context->callArgs(VM_SQRT, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_COS:
 	    context->updateLine(line);
 	    context->callArgs(VM_COS, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_SIN:
 	    context->updateLine(line);
 	    context->callArgs(VM_SIN, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_TAN:
 	    context->updateLine(line);
 	    context->callArgs(VM_TAN, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_ACOS:
 	    context->updateLine(line);
 	    context->callArgs(VM_ACOS, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_ASIN:
 	    context->updateLine(line);
 	    context->callArgs(VM_ASIN, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_ATAN:
 	    context->updateLine(line);
 	    context->callArgs(VM_ATAN, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_ATAN2:
 	    context->updateLine(line);
 	    context->callArgs(VM_ATAN2, tmpRef(sp));
-	    fprintf(context->stream, Double " %s, " Double " %s)\n",
-		    tmpRef(context->nextSp(context->sp)),
-		    tmpRef(context->sp));
+	    context->endCall(Double " %s, " Double " %s",
+			     tmpRef(context->nextSp(context->sp)),
+			     tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_COSH:
 	    context->updateLine(line);
 	    context->callArgs(VM_COSH, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_SINH:
 	    context->updateLine(line);
 	    context->callArgs(VM_SINH, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
 	case KF_TANH:
 	    context->updateLine(line);
 	    context->callArgs(VM_TANH, tmpRef(sp));
-	    fprintf(context->stream, Double " %s)\n", tmpRef(context->sp));
+	    context->endCall(Double " %s", tmpRef(context->sp));
 	    pushResult(context);
 	    return;
 
@@ -1888,22 +2196,19 @@ void ClangCode::emit(GenContext *context)
 	    switch (offStack(context, sp)) {
 	    case LPC_TYPE_INT:
 		context->callArgs(VM_KFUNC_INT, tmpRef(sp));
-		fprintf(context->stream, "i16 %u, i32 %u)\n", kfun.func,
-			kfun.nargs);
+		context->endCall("i16 %u, i32 %u", kfun.func, kfun.nargs);
 		context->sp = sp;
 		return;
 
 	    case LPC_TYPE_FLOAT:
 		context->callArgs(VM_KFUNC_FLOAT, tmpRef(sp));
-		fprintf(context->stream, "i16 %u, i32 %u)\n", kfun.func,
-			kfun.nargs);
+		context->endCall("i16 %u, i32 %u", kfun.func, kfun.nargs);
 		context->sp = sp;
 		return;
 	    }
 
 	    context->voidCallArgs(VM_KFUNC);
-	    fprintf(context->stream, "i16 %u, i32 %d)\n", kfun.func,
-		    kfun.nargs);
+	    context->endCall("i16 %u, i32 %d", kfun.func, kfun.nargs);
 	    break;
 	}
 	break;
@@ -1911,7 +2216,7 @@ void ClangCode::emit(GenContext *context)
     case KFUNC_LVAL:
 	context->updateLine(line);
 	context->voidCallArgs(VM_KFUNC);
-	fprintf(context->stream, "i16 %u, i32 %d)\n", kfun.func, kfun.nargs);
+	context->endCall("i16 %u, i32 %d", kfun.func, kfun.nargs);
 	break;
 
     case KFUNC_SPREAD:
@@ -1919,28 +2224,26 @@ void ClangCode::emit(GenContext *context)
 	switch (offStack(context, sp)) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_KFUNC_SPREAD_INT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i32 %u)\n", kfun.func,
-		    kfun.nargs);
+	    context->endCall("i16 %u, i32 %u", kfun.func, kfun.nargs);
 	    context->sp = sp;
 	    return;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_KFUNC_SPREAD_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i32 %u)\n", kfun.func,
-		    kfun.nargs);
+	    context->endCall("i16 %u, i32 %u", kfun.func, kfun.nargs);
 	    context->sp = sp;
 	    return;
 	}
 
 	context->voidCallArgs(VM_KFUNC_SPREAD);
-	fprintf(context->stream, "i16 %u, i32 %u)\n", kfun.func, kfun.nargs);
+	context->endCall("i16 %u, i32 %u", kfun.func, kfun.nargs);
 	break;
 
     case KFUNC_SPREAD_LVAL:
 	context->updateLine(line);
 	context->voidCallArgs(VM_KFUNC_SPREAD_LVAL);
-	fprintf(context->stream, "i16 %u, i16 %u, i32 %u)\n", kfun.lval,
-		kfun.func, kfun.nargs);
+	context->endCall("i16 %u, i16 %u, i32 %u", kfun.lval, kfun.func,
+			 kfun.nargs);
 	break;
 
     case DFUNC:
@@ -1948,22 +2251,22 @@ void ClangCode::emit(GenContext *context)
 	switch (offStack(context, sp)) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_DFUNC_INT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		    dfun.func, dfun.nargs);
+	    context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			     dfun.nargs);
 	    context->sp = sp;
 	    return;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_DFUNC_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		    dfun.func, dfun.nargs);
+	    context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			     dfun.nargs);
 	    context->sp = sp;
 	    return;
 	}
 
 	context->voidCallArgs(VM_DFUNC);
-	fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		dfun.func, dfun.nargs);
+	context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			 dfun.nargs);
 	break;
 
     case DFUNC_SPREAD:
@@ -1971,34 +2274,34 @@ void ClangCode::emit(GenContext *context)
 	switch (offStack(context, sp)) {
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_DFUNC_SPREAD_INT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		    dfun.func, dfun.nargs);
+	    context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			     dfun.nargs);
 	    context->sp = sp;
 	    return;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_DFUNC_SPREAD_FLOAT, tmpRef(sp));
-	    fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		    dfun.func, dfun.nargs);
+	    context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			     dfun.nargs);
 	    context->sp = sp;
 	    return;
 	}
 
 	context->voidCallArgs(VM_DFUNC_SPREAD);
-	fprintf(context->stream, "i16 %u, i8 %u, i32 %u)\n", dfun.inherit,
-		dfun.func, dfun.nargs);
+	context->endCall("i16 %u, i8 %u, i32 %u", dfun.inherit, dfun.func,
+			 dfun.nargs);
 	break;
 
     case FUNC:
 	context->updateLine(line);
 	context->voidCallArgs(VM_FUNC);
-	fprintf(context->stream, "i16 %u, i32 %u)\n", fun.call, fun.nargs);
+	context->endCall("i16 %u, i32 %u", fun.call, fun.nargs);
 	break;
 
     case FUNC_SPREAD:
 	context->updateLine(line);
 	context->voidCallArgs(VM_FUNC_SPREAD);
-	fprintf(context->stream, "i16 %u, i32 %u)\n", fun.call, fun.nargs);
+	context->endCall("i16 %u, i32 %u", fun.call, fun.nargs);
 	break;
 
     case CATCH:
@@ -2020,9 +2323,9 @@ void ClangCode::emit(GenContext *context)
     case CAUGHT:
 	context->voidCallArgs(VM_CAUGHT);
 	if (pop) {
-	    fprintf(context->stream, "i1 false)\n");
+	    context->endCall("i1 false");
 	} else {
-	    fprintf(context->stream, "i1 true)\n");
+	    context->endCall("i1 true");
 	}
 	context->sp = sp;
 	return;
@@ -2034,13 +2337,13 @@ void ClangCode::emit(GenContext *context)
     case RLIMITS:
 	context->updateLine(line);
 	context->voidCallArgs(VM_RLIMITS);
-	fprintf(context->stream, "i1 true)\n");
+	context->endCall("i1 true");
 	break;
 
     case RLIMITS_CHECK:
 	context->updateLine(line);
 	context->voidCallArgs(VM_RLIMITS);
-	fprintf(context->stream, "i1 false)\n");
+	context->endCall("i1 false");
 	break;
 
     case END_RLIMITS:
@@ -2110,6 +2413,7 @@ Code *ClangCode::create(CodeFunction *function)
 ClangBlock::ClangBlock(Code *first, Code *last, CodeSize size) :
     FlowBlock(first, last, size)
 {
+    nSplits = 0;
 }
 
 ClangBlock::~ClangBlock()
@@ -2132,6 +2436,27 @@ void ClangBlock::emit(GenContext *context, CodeFunction *function)
 
     FlowBlock::evaluate(context);
 
+    /*
+     * blocks are split by cold paths, and phi nodes may refer to the last
+     * part of a block before it is emitted
+     */
+    for (b = this; b != NULL; b = b->next) {
+	for (code = b->first; ; code = code->next) {
+	    if (code->instruction == Code::KFUNC) {
+		switch (code->kfun.func) {
+		case KF_DIV_INT:
+		case KF_MOD_INT:
+		case KF_LSHIFT_INT:
+		    ((ClangBlock *) b)->nSplits += 2;
+		    break;
+		}
+	    }
+	    if (code == b->last) {
+		break;
+	    }
+	}
+    }
+
     fprintf(context->stream, "Lparam:\n");
     nParams = function->nargs + function->vargs;
     for (n = 1; n <= nParams; n++) {
@@ -2139,13 +2464,13 @@ void ClangBlock::emit(GenContext *context, CodeFunction *function)
 	case LPC_TYPE_INT:
 	    context->callArgs(VM_PARAM_INT,
 			      ClangCode::paramRef(nParams - n, 0));
-	    fprintf(context->stream, "i8 %d)\n", nParams - n);
+	    context->endCall("i8 %d", nParams - n);
 	    break;
 
 	case LPC_TYPE_FLOAT:
 	    context->callArgs(VM_PARAM_FLOAT,
 			      ClangCode::paramRef(nParams - n, 0));
-	    fprintf(context->stream, "i8 %d)\n", nParams - n);
+	    context->endCall("i8 %d", nParams - n);
 	    break;
 
 	default:
@@ -2376,24 +2701,67 @@ void ClangObject::table(FILE *stream, int nFunctions)
 }
 
 /*
- * create a dynamically loadable object
+ * generate branch counters, and a null-terminated table to find them
  */
-bool ClangObject::emit(char *base, int flags)
+void ClangObject::counters(FILE *stream, int nBranches)
+{
+    int i;
+
+    fprintf(stream, "@counters ="
+# ifdef WIN32
+				" dllexport"
+# endif
+					   " constant [%d x [2 x i64]*] [",
+	    nBranches + 1);
+    for (i = 0; i < nBranches; i++) {
+	fprintf(stream, "[2 x i64]* @b%d, ", i);
+    }
+    fprintf(stream, "[2 x i64]* null], align %d\n", (int) sizeof(void *));
+}
+
+/*
+ * create a dynamically loadable object, optimized at level 1-3, or for size
+ * at level 0; conditional branches are counted if flags include JIT_PROFILE,
+ * or weighed by a profile from such an object.  A failure is transient if
+ * the compiler did not reject the program, but could not be run.
+ */
+bool ClangObject::emit(char *base, int flags, int level, uint64_t *profile,
+		       int profileSize, bool *transient)
 {
     char buffer[1000];
     FILE *stream;
-    int i;
+# ifdef LLVM
+    char *ir;
+    size_t size;
+    bool result;
+# else
+    int status;
+# endif
+    int i, branch, n;
 
+# ifdef LLVM
+    /*
+     * generate IR in memory
+     */
+    stream = open_memstream(&ir, &size);
+# else
     /*
      * generate .ll file
      */
     sprintf(buffer, "%s.ll", base);
     stream = fopen(buffer, "w");
+# endif
+    *transient = true;
+    if (stream == NULL) {
+	return false;
+    }
+    *transient = false;
 
     header(stream);
 
     table(stream, nFunctions);
 
+    branch = 0;
     for (i = 1; i <= nFunctions; i++) {
 	CodeFunction func(object, prog);
 	Block *b = Block::function(&func);
@@ -2402,11 +2770,21 @@ bool ClangObject::emit(char *base, int flags)
 		"\ndefine internal void @func%d(i8** %%vmtab, i8* %%f) #1 {\n",
 		i);
 	if (b != NULL) {
-	    GenContext context(stream, &func, b->fragment(), i, flags);
+	    GenContext context(stream, &func, b->fragment(), i, flags, branch,
+			       profile, profileSize);
 	    ClangCode *code;
 
+	    fprintf(stream, "\tbr label %%Lvm\n");
 	    b->emit(&context, &func);
+	    context.loadFunctions();
 	    fprintf(stream, "}\n");
+	    if (flags & JIT_PROFILE) {
+		for (n = branch; n < context.branch; n++) {
+		    fprintf(stream, "@b%d = internal global [2 x i64] "
+				    "zeroinitializer, align 8\n", n);
+		}
+	    }
+	    branch = context.branch;
 	    for (code = context.switchList; code != NULL; code = code->list) {
 		if (code->instruction == Code::SWITCH_RANGE) {
 		    code->emitRangeTable(&context);
@@ -2421,16 +2799,42 @@ bool ClangObject::emit(char *base, int flags)
 	prog = func.endProg();
     }
 
+    if (flags & JIT_PROFILE) {
+	counters(stream, branch);
+    }
+
     /* attributes */
     fprintf(stream, "attributes #0 = { nounwind returns_twice }\n");
     fprintf(stream, "attributes #1 = { nounwind "
 		    "\"no-frame-pointer-elim\"=\"false\" }\n");
+    fprintf(stream, "attributes " NOUNWIND " = { nounwind }\n");
+# ifndef LLVM3_6
+    fprintf(stream, "attributes " READ_VM " = { nounwind readonly "
+		    "willreturn }\n");
+# else
+    fprintf(stream, "attributes " READ_VM " = { nounwind readonly }\n");
+# endif
 
     fclose(stream);
 
     /*
-     * compile .ll file to shared object
+     * compile IR to shared object, keeping diagnostics on failure
      */
+# ifdef LLVM
+# ifdef KEEP_IR
+    sprintf(buffer, "%s.ll", base);
+    stream = fopen(buffer, "w");
+    if (stream != NULL) {
+	fwrite(ir, 1, size, stream);
+	fclose(stream);
+    }
+# endif
+    result = LLVMCompiler::compile(base, ir, size, level, transient);
+    free(ir);
+    if (!result) {
+	return false;
+    }
+# else
     sprintf(buffer,
 # ifndef WIN32
 	    "clang -fPIC"
@@ -2442,7 +2846,7 @@ bool ClangObject::emit(char *base, int flags)
 # ifndef LLVM3_6
 	    " -march=native"
 # endif
-	    " -Os -shared"
+	    " -O%c -shared"
 # if defined(__APPLE__) || defined(WIN32)
 	    " -Wno-override-module"
 # endif
@@ -2451,6 +2855,20 @@ bool ClangObject::emit(char *base, int flags)
 # else
 	    " -o %s.dll"
 # endif
-	    " %s.ll", base, base);
-    return (system(buffer) == 0);
+	    " %s.ll 2> %s.err", "s123"[level], base, base, base);
+    status = system(buffer);
+    if (status != 0) {
+# ifndef WIN32
+	/* the shell could not run clang, or clang was killed */
+	*transient = (status < 0 || !WIFEXITED(status) ||
+		      WEXITSTATUS(status) == 127);
+# else
+	*transient = (status < 0);
+# endif
+	return false;
+    }
+# endif
+    sprintf(buffer, "%s.err", base);
+    remove(buffer);
+    return true;
 }
@@ -23,7 +23,12 @@ private:
     void pushResult(class GenContext *context);
     void popResult(class GenContext *context);
     void popStores(class GenContext *context, StackSize sp);
+    void checkedInt(class GenContext *context, const char *op, int func,
+		    bool shift);
     void switchInt(class GenContext *context);
+    int rangeCases(int max);
+    void rangeEntry(class GenContext *context, char *ref, char *index);
+    char *rangeIndex(class GenContext *context);
     void genTable(class GenContext *context, const char *type);
 };
 
@@ -35,6 +40,8 @@ public:
     virtual void emit(class GenContext *context, CodeFunction *function);
 
     static Block *create(Code *first, Code *last, CodeSize size);
+
+    int nSplits;		/* # times split for cold paths */
 };
 
 class ClangObject {
@@ -42,11 +49,13 @@ public:
     ClangObject(CodeObject *object, CodeByte *prog, int nFunctions);
     virtual ~ClangObject();
 
-    bool emit(char *base, int flags);
+    bool emit(char *base, int flags, int level, uint64_t *profile,
+	      int profileSize, bool *transient);
 
 private:
     void header(FILE *stream);
     void table(FILE *stream, int nFunctions);
+    void counters(FILE *stream, int nBranches);
 
     CodeObject *object;		/* object being compiled */
     CodeByte *prog;		/* LPC bytecode */
@@ -1,3 +1,6 @@
+# ifdef __linux__
+# define _GNU_SOURCE
+# endif
 # ifndef WIN32
 # include <stdlib.h>
 # include <unistd.h>
@@ -5,7 +8,14 @@
 # include <string.h>
 # include <sys/types.h>
 # include <sys/stat.h>
+# include <sys/uio.h>
+# include <sys/mman.h>
+# include <dirent.h>
 # include <dlfcn.h>
+# ifdef __linux__
+# include <sys/eventfd.h>
+# include <poll.h>
+# endif
 # else
 # include <Windows.h>
 # include <process.h>
@@ -20,65 +30,822 @@
 # endif
 # include <fcntl.h>
 # include <stdio.h>
+# include <time.h>
 # include "lpc_ext.h"
 # include "jit.h"
 
 
+# ifndef WIN32
+# define THREAD_START(tid, func) pthread_create(&tid, NULL, func, NULL)
+# define THREAD_STOP(tid)	pthread_join(tid, NULL)
+# define MUTEX_INIT(lock)	pthread_mutex_init(lock, NULL)
+# define MUTEX_DESTROY(lock)	pthread_mutex_destroy(lock)
+# define MUTEX_LOCK(lock)	pthread_mutex_lock(lock)
+# define MUTEX_UNLOCK(lock)	pthread_mutex_unlock(lock)
+# define COND_INIT(cond)	pthread_cond_init(cond, NULL)
+# define COND_DESTROY(cond)	pthread_cond_destroy(cond)
+# define COND_WAIT(cond, lock)	pthread_cond_wait(cond, lock)
+# define COND_SIGNAL(cond)	pthread_cond_signal(cond)
+# define KEY_CREATE(key, func)	pthread_key_create(key, func)
+# define KEY_DELETE(key)	pthread_key_delete(key)
+# define KEY_SET(key, value)	pthread_setspecific(key, value)
+# define DLL_OPEN(mod)		dlopen(mod, RTLD_NOW | RTLD_LOCAL)
+# define DLL_CLOSE(handle)	dlclose(handle)
+# define DLL_SYM(handle, sym)	dlsym(handle, sym)
+# define O_BINARY		0
+# define DLL_EXT		".so"
+# define THREAD_LOCAL		__thread
+# define ATOMIC_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define ATOMIC_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+# define ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+# define ATOMIC_INC(p)		__atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+# define ATOMIC_DEC(p)		__atomic_sub_fetch(p, 1, __ATOMIC_RELEASE)
+# define ATOMIC_ADD64(p, v)	__atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+# define ATOMIC_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef void* Handle;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_key_t Key;
+
+static pthread_t tid, wtid, ptid;
+# else
+# define THREAD_START(tid, func) _beginthread((void (*)(void*)) func, 0, NULL)
+# define THREAD_STOP(tid)	/* */
+# define MUTEX_INIT(lock)	InitializeCriticalSection(lock)
+# define MUTEX_DESTROY(lock)	DeleteCriticalSection(lock)
+# define MUTEX_LOCK(lock)	EnterCriticalSection(lock)
+# define MUTEX_UNLOCK(lock)	LeaveCriticalSection(lock)
+# define COND_INIT(cond)	InitializeConditionVariable(cond)
+# define COND_DESTROY(cond)	/* */
+# define COND_WAIT(cond, lock)	SleepConditionVariableCS(cond, lock, INFINITE)
+# define COND_SIGNAL(cond)	WakeConditionVariable(cond)
+# define KEY_CREATE(key, func)	((*(key) = FlsAlloc((PFLS_CALLBACK_FUNCTION) \
+						   func)) == FLS_OUT_OF_INDEXES)
+# define KEY_DELETE(key)	FlsFree(key)
+# define KEY_SET(key, value)	FlsSetValue(key, value)
+# define DLL_OPEN(mod)		LoadLibrary((LPCSTR) mod)
+# define DLL_CLOSE(handle)	FreeLibrary(handle)
+# define DLL_SYM(handle, sym)	GetProcAddress(handle, (LPCSTR) sym)
+# define alloca			_alloca
+# define access			_access
+# define mkdir(path, mode)	_mkdir(path)
+# define open			_open
+# define write			_write
+# define close			_close
+# define unlink			_unlink
+# define read			_read
+# define ftruncate(fd, size)	((_chsize_s(fd, size) == 0) ? 0 : -1)
+# define DLL_EXT		".dll"
+# define THREAD_LOCAL		__declspec(thread)
+# define ATOMIC_LOAD(p)		(*(p))
+# define ATOMIC_STORE(p, v)	(*(p) = (v))
+# define ATOMIC_CAS(p, o, n)	(InterlockedCompareExchange((volatile LONG *) \
+						    (p), n, o) == (o))
+# define ATOMIC_INC(p)		InterlockedIncrement((volatile LONG *) (p))
+# define ATOMIC_DEC(p)		InterlockedDecrement((volatile LONG *) (p))
+# define ATOMIC_ADD64(p, v)	InterlockedExchangeAdd64((volatile LONG64 *) \
+							 (p), v)
+# define ATOMIC_FENCE()		MemoryBarrier()
+
+typedef HMODULE Handle;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef DWORD Key;
+
+struct iovec {
+    void *iov_base;		/* segment */
+    size_t iov_len;		/* segment size */
+};
+# endif
+
+static Mutex lock;
+
+
 typedef struct Program {
     uint8_t hash[16];		/* program hash */
     void *handle;		/* dll handle */
-    LPC_function *functions;	/* function table */
+    void *base;			/* dll handle of replaced baseline tier */
+    LPC_function *volatile functions; /* function table */
     uint64_t refCount;		/* reference count */
-    struct Program *next;	/* next in linked list */
+    volatile uint32_t calls;	/* # calls */
+    volatile uint32_t execs;	/* # sampled calls to compiled code */
+    volatile uint32_t tier;	/* tier of function table, 0 if none */
+    volatile uint32_t hot;	/* optimization requested */
+    volatile uint32_t hinted;	/* hotness hint queued */
+    volatile uint32_t running;	/* calls into its code in progress */
+    uint64_t index;		/* first object with this program */
+    uint64_t instance;		/* instance of that object */
 } Program;
 
 typedef struct Object {
     uint64_t index;		/* object index */
     uint64_t instance;		/* object instance */
-    Program *program;		/* program */
-    struct Object *next;	/* next in linked list */
+    Program *volatile program;	/* program */
+    volatile uint32_t calls;	/* # calls before compiled */
 } Object;
 
-# define NOBJECTS	10243
+/*
+ * Statistics are kept in counters that are updated atomically, and in
+ * histograms of durations with power-of-two buckets, in nanoseconds.  They
+ * are made available through the jit_statistics() kfun.
+ */
+enum {
+    STAT_EXEC_JIT,		/* jit_execute() ran JIT compiled code */
+    STAT_EXEC_NONE,		/* jit_execute() found no JIT compiled code */
+    STAT_EXEC_REQUEST,		/* jit_execute() requested the program */
+    STAT_SUBMITTED,		/* programs queued for the cache */
+    STAT_DROPPED,		/* programs dropped from a full queue */
+    STAT_HINTS,			/* hotness hints queued */
+    STAT_CACHE_HITS,		/* shared objects reused from the cache */
+    STAT_CACHE_MISSES,		/* programs written to the cache */
+    STAT_SKIPPED,		/* programs known to fail */
+    STAT_COMPILED,		/* programs compiled */
+    STAT_FAILED,		/* programs that failed to compile */
+    STAT_TRANSIENT,		/* compilations that may be retried */
+    STAT_LOADED,		/* shared objects loaded */
+    STAT_LOAD_FAILED,		/* shared objects that failed to load */
+    STAT_PRELOADED,		/* shared objects preloaded */
+    STAT_CLAIMED,		/* preloaded shared objects claimed */
+    STAT_UNLOADED,		/* shared objects unloaded */
+    STAT_EVICTED,		/* programs removed from the cache */
+    STAT_FRAMES,		/* frames sent */
+    STAT_RECORDS,		/* records sent in frames */
+    STAT_RING_PROGRAMS,		/* programs passed through shared memory */
+    STAT_OPTIMIZE,		/* hot programs queued for optimization */
+    STAT_OPTIMIZED,		/* baseline function tables replaced */
+    STAT_UNINDEXED,		/* programs compiled without an index record */
+    STATS
+};
+
+static const char *statNames[STATS] = {
+    "execute_jit", "execute_none", "execute_request", "submitted", "dropped",
+    "hints", "cache_hits", "cache_misses", "skipped", "compiled", "failed",
+    "transient", "loaded", "load_failed", "preloaded", "claimed", "unloaded",
+    "evicted", "frames_sent", "records_sent", "ring_programs", "optimize",
+    "optimized", "unindexed"
+};
+
+enum {
+    HIST_SUBMIT,		/* time spent in jit_compile() */
+    HIST_COMPILE,		/* from compile request to result */
+    HIST_LOAD,			/* loading a shared object */
+    HIST_EXECUTE,		/* JIT compiled function calls, sampled */
+    HISTS
+};
+
+static const char *histNames[HISTS] = {
+    "submit_time", "compile_time", "load_time", "execute_time"
+};
+
+# define HIST_BUCKETS	40	/* # buckets, up to 2^40 ns */
+# define EXEC_SAMPLE	63	/* time 1 in 64 function calls */
+# define HOT_SAMPLE	15	/* count 1 in 16 calls towards hotness */
+
+static volatile uint64_t stats[STATS];			/* counters */
+static volatile uint64_t hists[HISTS][HIST_BUCKETS];	/* histograms */
+static THREAD_LOCAL uint32_t execCount;			/* calls by thread */
+static THREAD_LOCAL uint32_t hotCount;			/* for hotness samples */
+
+# define STAT(s)	ATOMIC_ADD64(&stats[s], 1)
+
+/*
+ * NAME:	Stats->now()
+ * DESCRIPTION:	return monotonic time in nanoseconds
+ */
+static uint64_t st_now(void)
+{
+# ifndef WIN32
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+# else
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (freq.QuadPart == 0) {
+	QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t) (count.QuadPart / freq.QuadPart) * 1000000000 +
+	   (uint64_t) (count.QuadPart % freq.QuadPart) * 1000000000 /
+	   freq.QuadPart;
+# endif
+}
+
+/*
+ * NAME:	Stats->time()
+ * DESCRIPTION:	add the time elapsed since start to a histogram
+ */
+static void st_time(int hist, uint64_t start)
+{
+    uint64_t ns;
+    int b;
 
-static Program *programs[NOBJECTS];
-static Object *objects[NOBJECTS];
+    ns = st_now() - start;
+    for (b = 0; ns > 1 && b < HIST_BUCKETS - 1; b++) {
+	ns >>= 1;
+    }
+    ATOMIC_ADD64(&hists[hist][b], 1);
+}
 
 /*
- * NAME:	Program->find()
- * DESCRIPTION:	find entry by hash
+ * Program and Object records are allocated from per-type slabs: large
+ * chunks carved into records of equal size, with freed records kept in a
+ * free list.  All slab operations happen with the lock held.
+ */
+# define SLAB_CHUNK	65536	/* size of a chunk */
+
+typedef struct SlabChunk {
+    struct SlabChunk *next;	/* next chunk */
+} SlabChunk;
+
+typedef struct SlabFree {
+    struct SlabFree *next;	/* next free record */
+} SlabFree;
+
+typedef struct {
+    size_t size;		/* record size */
+    SlabChunk *chunks;		/* allocated chunks */
+    SlabFree *free;		/* free records */
+} Slab;
+
+# define SLAB_ALIGN(s)	(((s) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+# define SLAB_INIT(t)	{ SLAB_ALIGN(sizeof(t)), NULL, NULL }
+
+static Slab programSlab = SLAB_INIT(Program);
+static Slab objectSlab = SLAB_INIT(Object);
+
+/*
+ * NAME:	Slab->alloc()
+ * DESCRIPTION:	allocate a record, or return NULL if out of memory
+ */
+static void *s_alloc(Slab *s)
+{
+    SlabChunk *chunk;
+    SlabFree *f;
+    char *p;
+    size_t n;
+
+    if (s->free == NULL) {
+	/* carve up a new chunk */
+	chunk = malloc(SLAB_CHUNK);
+	if (chunk == NULL) {
+	    return NULL;
+	}
+	chunk->next = s->chunks;
+	s->chunks = chunk;
+	p = (char *) chunk + SLAB_ALIGN(sizeof(SlabChunk));
+	for (n = (SLAB_CHUNK - SLAB_ALIGN(sizeof(SlabChunk))) / s->size;
+	     n != 0; --n, p += s->size) {
+	    f = (SlabFree *) p;
+	    f->next = s->free;
+	    s->free = f;
+	}
+    }
+
+    f = s->free;
+    s->free = f->next;
+    return f;
+}
+
+/*
+ * NAME:	Slab->free()
+ * DESCRIPTION:	free a record
+ */
+static void s_free(Slab *s, void *record)
+{
+    SlabFree *f;
+
+    f = (SlabFree *) record;
+    f->next = s->free;
+    s->free = f;
+}
+
+
+/*
+ * Objects are looked up without holding the lock.  Readers announce the
+ * global epoch in a per-thread slot while they traverse the object table;
+ * entries removed from the table are retired, and freed only when every
+ * reader that might still see them has left.  Threads that cannot get a
+ * slot of their own fall back to holding the lock while reading.
+ *
+ * A critical section only covers the lookup, never a call into JIT compiled
+ * code, which an LPC error may unwind without returning.  Instead, calls in
+ * progress are counted per program, and the shared objects of a removed
+ * program are unloaded in batches by the loader thread, outside the lock,
+ * once the program has been retired and no calls into it are left.  A
+ * call abandoned by an error keeps only the shared objects of its own
+ * program loaded.
+ */
+# define EPOCH_SLOTS	256	/* # threads with an epoch slot */
+
+typedef struct {
+    volatile uint64_t epoch;	/* epoch when entered, or 0 */
+    volatile uint32_t used;	/* claimed by a thread? */
+    char pad[52];		/* one slot per cache line */
+} EpochSlot;
+
+typedef struct {
+    void *item;			/* retired memory */
+    Slab *slab;			/* slab of item, or NULL */
+    uint64_t epoch;		/* epoch when retired */
+} Retired;
+
+static EpochSlot slots[EPOCH_SLOTS];	/* per-thread epoch slots */
+static EpochSlot noSlot;		/* marker for threads without slot */
+static volatile uint32_t nSlots;	/* # slots claimed */
+static volatile uint64_t epoch = 1;	/* global epoch */
+static THREAD_LOCAL EpochSlot *slot;	/* slot of current thread */
+static Key slotKey;			/* releases slot on thread exit */
+static Retired *retired;		/* retired items */
+static size_t nRetired, retiredSize;	/* # retired items, array size */
+static Retired *unloads;		/* retired shared objects */
+static size_t nUnloads, unloadsSize;	/* # retired, array size */
+static Handle *closing;			/* shared objects to unload */
+static size_t nClosing, closingSize;	/* # to unload, array size */
+
+/*
+ * NAME:	Epoch->release()
+ * DESCRIPTION:	release the slot of a thread that exits
+ */
+static void e_release(void *s)
+{
+    ATOMIC_STORE(&((EpochSlot *) s)->epoch, 0);
+    ATOMIC_STORE(&((EpochSlot *) s)->used, 0);
+}
+
+/*
+ * NAME:	Epoch->enter()
+ * DESCRIPTION:	enter a read-side critical section, return false if the
+ *		lock was taken instead
+ */
+static bool e_enter(void)
+{
+    EpochSlot *s;
+    uint32_t i, n;
+
+    s = slot;
+    if (s == NULL) {
+	/* claim a slot */
+	s = &noSlot;
+	for (i = 0; i < EPOCH_SLOTS; i++) {
+	    if (ATOMIC_CAS(&slots[i].used, 0, 1)) {
+		s = &slots[i];
+		KEY_SET(slotKey, s);
+		do {
+		    n = ATOMIC_LOAD(&nSlots);
+		} while (n <= i && !ATOMIC_CAS(&nSlots, n, i + 1));
+		break;
+	    }
+	}
+	slot = s;
+    }
+    if (s == &noSlot) {
+	MUTEX_LOCK(&lock);
+	return false;
+    }
+
+    ATOMIC_STORE(&s->epoch, ATOMIC_LOAD(&epoch));
+    ATOMIC_FENCE();
+    return true;
+}
+
+/*
+ * NAME:	Epoch->exit()
+ * DESCRIPTION:	leave a read-side critical section
+ */
+static void e_exit(bool entered)
+{
+    if (!entered) {
+	MUTEX_UNLOCK(&lock);
+    } else {
+	ATOMIC_STORE(&slot->epoch, 0);
+    }
+}
+
+/*
+ * NAME:	Epoch->retire()
+ * DESCRIPTION:	free memory once no reader can reference it anymore (called
+ *		with lock held)
+ */
+static void e_retire(void *item, Slab *slab)
+{
+    if (nRetired == retiredSize) {
+	retiredSize = (retiredSize == 0) ? 64 : retiredSize << 1;
+	retired = realloc(retired, retiredSize * sizeof(Retired));
+    }
+    retired[nRetired].item = item;
+    retired[nRetired].slab = slab;
+    retired[nRetired].epoch = epoch;
+    nRetired++;
+}
+
+/*
+ * NAME:	Epoch->unload()
+ * DESCRIPTION:	unload a shared object, or the shared objects of a removed
+ *		program from the given slab, once no thread can be running
+ *		its code anymore (called with lock held)
+ */
+static void e_unload(void *item, Slab *slab)
+{
+    if (nUnloads == unloadsSize) {
+	unloadsSize = (unloadsSize == 0) ? 64 : unloadsSize << 1;
+	unloads = realloc(unloads, unloadsSize * sizeof(Retired));
+    }
+    unloads[nUnloads].item = item;
+    unloads[nUnloads].slab = slab;
+    unloads[nUnloads].epoch = epoch;
+    nUnloads++;
+}
+
+/*
+ * NAME:	Epoch->closing()
+ * DESCRIPTION:	add a shared object to those to unload (called with lock
+ *		held)
+ */
+static void e_closing(Handle handle)
+{
+    if (nClosing == closingSize) {
+	closingSize = (closingSize == 0) ? 64 : closingSize << 1;
+	closing = realloc(closing, closingSize * sizeof(Handle));
+    }
+    closing[nClosing++] = handle;
+}
+
+/*
+ * NAME:	Epoch->reclaim()
+ * DESCRIPTION:	attempt to advance the global epoch, and free retired items
+ *		that are no longer visible (called with lock held)
  */
-static Program **p_find(uint8_t *hash)
+static void e_reclaim(void)
 {
-    Program **r;
+    Program *p;
+    uint64_t e, current;
+    uint32_t i, n;
+    size_t j, k;
+
+    if (nRetired == 0 && nUnloads == 0) {
+	return;
+    }
 
-    for (r = &programs[*(uint64_t *) hash % NOBJECTS]; *r != NULL;
-	 r = &(*r)->next) {
-	if (memcmp((*r)->hash, hash, 16) == 0) {
+    /* all active readers must have seen the current epoch */
+    ATOMIC_FENCE();
+    current = epoch;
+    n = ATOMIC_LOAD(&nSlots);
+    for (i = 0; i < n; i++) {
+	e = ATOMIC_LOAD(&slots[i].epoch);
+	if (e != 0 && e != current) {
 	    break;
 	}
     }
+    if (i == n) {
+	ATOMIC_STORE(&epoch, ++current);
+    }
+
+    for (j = k = 0; j < nRetired; j++) {
+	if (retired[j].epoch + 2 <= current) {
+	    if (retired[j].slab != NULL) {
+		s_free(retired[j].slab, retired[j].item);
+	    } else {
+		free(retired[j].item);
+	    }
+	} else {
+	    retired[k++] = retired[j];
+	}
+    }
+    nRetired = k;
+
+    /* collect shared objects to unload */
+    for (j = k = 0; j < nUnloads; j++) {
+	if (unloads[j].epoch + 2 > current) {
+	    unloads[k++] = unloads[j];
+	} else if (unloads[j].slab == NULL) {
+	    e_closing((Handle) unloads[j].item);
+	} else {
+	    p = (Program *) unloads[j].item;
+	    if (ATOMIC_LOAD(&p->running) != 0) {
+		unloads[k++] = unloads[j];	/* still running */
+	    } else {
+		if (p->handle != NULL) {
+		    e_closing((Handle) p->handle);
+		}
+		if (p->base != NULL) {
+		    e_closing((Handle) p->base);
+		}
+		s_free(unloads[j].slab, p);
+	    }
+	}
+    }
+    nUnloads = k;
+}
+
+/*
+ * NAME:	Epoch->close()
+ * DESCRIPTION:	unload the shared objects collected by e_reclaim() (called
+ *		by the loader thread, without lock)
+ */
+static void e_close(void)
+{
+    size_t i;
+
+    for (i = 0; i < nClosing; i++) {
+	DLL_CLOSE(closing[i]);
+    }
+    ATOMIC_ADD64(&stats[STAT_UNLOADED], nClosing);
+    nClosing = 0;
+}
+
+/*
+ * Hash tables use open addressing with linear probing.  A table that gets
+ * too full is replaced by a larger one, and the entries are moved over a
+ * few at a time by subsequent updates, so no single update stalls.  Lookups
+ * may happen without locking; updates require the lock.
+ */
+# define HASH_INITIAL	1024	/* initial # slots */
+# define HASH_REHASH	32	/* # old slots to rehash per update */
+# define TOMBSTONE	((void *) &tombstone)
+
+typedef struct {
+    volatile uint64_t hash;	/* hash value of entry */
+    void *volatile entry;	/* entry, NULL or TOMBSTONE */
+} HashSlot;
+
+typedef struct {
+    HashSlot *slots;		/* current slots */
+    HashSlot *old;		/* slots being rehashed, or NULL */
+    uint64_t mask;		/* # slots - 1 */
+    uint64_t oldMask;		/* # old slots - 1 */
+} HashTable;
+
+typedef struct {
+    HashTable *volatile table;	/* current table */
+    uint64_t count;		/* # entries */
+    uint64_t tombs;		/* # tombstones in current slots */
+    uint64_t rehash;		/* next old slot to rehash */
+} Hash;
+
+typedef bool (*HashEq)(void*, const void*);
+
+static char tombstone;
+
+/*
+ * NAME:	Hash->init()
+ * DESCRIPTION:	initialize a hash table
+ */
+static void h_init(Hash *h)
+{
+    HashTable *t;
+
+    t = malloc(sizeof(HashTable));
+    t->slots = calloc(HASH_INITIAL, sizeof(HashSlot));
+    t->old = NULL;
+    t->mask = HASH_INITIAL - 1;
+    t->oldMask = 0;
+    h->table = t;
+    h->count = h->tombs = h->rehash = 0;
+}
+
+/*
+ * NAME:	Hash->probe()
+ * DESCRIPTION:	find an entry in a slot array
+ */
+static void *h_probe(HashSlot *slots, uint64_t mask, uint64_t hash, HashEq eq,
+		     const void *key, HashSlot **slot)
+{
+    uint64_t i;
+    void *entry;
+
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+	entry = ATOMIC_LOAD(&slots[i].entry);
+	if (entry == NULL) {
+	    return NULL;
+	}
+	if (entry != TOMBSTONE && slots[i].hash == hash && (*eq)(entry, key)) {
+	    if (slot != NULL) {
+		*slot = &slots[i];
+	    }
+	    return entry;
+	}
+    }
+}
+
+/*
+ * NAME:	Hash->find()
+ * DESCRIPTION:	find an entry, safe to call without locking
+ */
+static void *h_find(Hash *h, uint64_t hash, HashEq eq, const void *key)
+{
+    HashTable *t;
+    void *entry;
+
+    do {
+	t = ATOMIC_LOAD(&h->table);
+	if (t->old != NULL) {
+	    /* entries are added to the new slots before leaving the old */
+	    entry = h_probe(t->old, t->oldMask, hash, eq, key, NULL);
+	    if (entry != NULL) {
+		return entry;
+	    }
+	}
+	entry = h_probe(t->slots, t->mask, hash, eq, key, NULL);
+    } while (entry == NULL && t != ATOMIC_LOAD(&h->table));
+
+    return entry;
+}
+
+/*
+ * NAME:	Hash->place()
+ * DESCRIPTION:	put an entry in the first free slot
+ */
+static bool h_place(HashSlot *slots, uint64_t mask, uint64_t hash, void *entry)
+{
+    uint64_t i;
+    void *e;
+
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+	e = slots[i].entry;
+	if (e == NULL || e == TOMBSTONE) {
+	    slots[i].hash = hash;
+	    ATOMIC_STORE(&slots[i].entry, entry);
+	    return (e == TOMBSTONE);
+	}
+    }
+}
+
+/*
+ * NAME:	Hash->step()
+ * DESCRIPTION:	rehash a few old slots, and start rehashing if the table
+ *		is getting too full
+ */
+static void h_step(Hash *h)
+{
+    HashTable *t, *n;
+    HashSlot *slot;
+    uint64_t size, end;
+    void *entry;
+
+    t = h->table;
+    if (t->old == NULL) {
+	if ((h->count + h->tombs + 1) * 4 <= (t->mask + 1) * 3) {
+	    return;
+	}
+
+	/* start rehashing into a new slot array */
+	for (size = t->mask + 1; (h->count + 1) * 2 > size; size <<= 1) ;
+	n = malloc(sizeof(HashTable));
+	n->slots = calloc(size, sizeof(HashSlot));
+	n->old = t->slots;
+	n->mask = size - 1;
+	n->oldMask = t->mask;
+	ATOMIC_STORE(&h->table, n);
+	e_retire(t, NULL);
+	h->tombs = 0;
+	h->rehash = 0;
+	t = n;
+    }
+
+    end = h->rehash + HASH_REHASH;
+    if (end > t->oldMask + 1) {
+	end = t->oldMask + 1;
+    }
+    while (h->rehash < end) {
+	slot = &t->old[h->rehash++];
+	entry = slot->entry;
+	if (entry != NULL && entry != TOMBSTONE) {
+	    h->tombs -= h_place(t->slots, t->mask, slot->hash, entry);
+	    ATOMIC_STORE(&slot->entry, TOMBSTONE);
+	}
+    }
+
+    if (h->rehash > t->oldMask) {
+	/* done */
+	n = malloc(sizeof(HashTable));
+	n->slots = t->slots;
+	n->old = NULL;
+	n->mask = t->mask;
+	n->oldMask = 0;
+	ATOMIC_STORE(&h->table, n);
+	e_retire(t->old, NULL);
+	e_retire(t, NULL);
+    }
+}
+
+/*
+ * NAME:	Hash->insert()
+ * DESCRIPTION:	add a new entry
+ */
+static void h_insert(Hash *h, uint64_t hash, void *entry)
+{
+    HashTable *t;
+
+    h_step(h);
+    t = h->table;
+    h->tombs -= h_place(t->slots, t->mask, hash, entry);
+    h->count++;
+}
+
+/*
+ * NAME:	Hash->remove()
+ * DESCRIPTION:	remove an entry
+ */
+static void h_remove(Hash *h, uint64_t hash, HashEq eq, const void *key)
+{
+    HashTable *t;
+    HashSlot *slot;
+
+    t = h->table;
+    if (t->old != NULL &&
+	h_probe(t->old, t->oldMask, hash, eq, key, &slot) != NULL) {
+	ATOMIC_STORE(&slot->entry, TOMBSTONE);
+    } else if (h_probe(t->slots, t->mask, hash, eq, key, &slot) != NULL) {
+	ATOMIC_STORE(&slot->entry, TOMBSTONE);
+	h->tombs++;
+    } else {
+	return;
+    }
+    h->count--;
+    h_step(h);
+}
+
+
+/*
+ * NAME:	Hash->each()
+ * DESCRIPTION:	call a function for each entry (with the lock held)
+ */
+static void h_each(Hash *h, void (*func)(void*, void*), void *arg)
+{
+    HashTable *t;
+    uint64_t i;
+    void *entry;
+
+    t = h->table;
+    for (i = 0; i <= t->mask; i++) {
+	entry = t->slots[i].entry;
+	if (entry != NULL && entry != TOMBSTONE) {
+	    (*func)(entry, arg);
+	}
+    }
+    if (t->old != NULL) {
+	for (i = 0; i <= t->oldMask; i++) {
+	    entry = t->old[i].entry;
+	    if (entry != NULL && entry != TOMBSTONE) {
+		(*func)(entry, arg);
+	    }
+	}
+    }
+}
+
+static Hash programs;		/* programs by hash */
+static Hash objects;		/* objects by index and instance */
+
+/*
+ * NAME:	Program->eq()
+ * DESCRIPTION:	compare program with hash
+ */
+static bool p_eq(void *entry, const void *key)
+{
+    return (memcmp(((Program *) entry)->hash, key, 16) == 0);
+}
 
-    return r;
+/*
+ * NAME:	Program->find()
+ * DESCRIPTION:	find entry by hash
+ */
+static Program *p_find(uint8_t *hash)
+{
+    return (Program *) h_find(&programs, *(uint64_t *) hash, &p_eq, hash);
 }
 
 /*
  * NAME:	Program->compile()
  * DESCRIPTION:	link cache entry to hash
  */
-static Program *p_new(uint8_t *hash)
+static Program *p_new(uint8_t *hash, uint64_t index, uint64_t instance)
 {
-    Program **r, *p;
+    Program *p;
 
-    r = p_find(hash);
-    p = *r;
+    p = p_find(hash);
     if (p == NULL) {
-	p = *r = malloc(sizeof(Program));
+	p = s_alloc(&programSlab);
+	if (p == NULL) {
+	    return NULL;
+	}
 	memcpy(p->hash, hash, 16);
 	p->handle = NULL;
+	p->base = NULL;
 	p->functions = NULL;
 	p->refCount = 0;
-	p->next = NULL;
+	p->calls = 0;
+	p->execs = 0;
+	p->tier = 0;
+	p->hot = 0;
+	p->hinted = 0;
+	p->running = 0;
+	p->index = index;
+	p->instance = instance;
+	h_insert(&programs, *(uint64_t *) hash, p);
     }
     p->refCount++;
 
@@ -86,219 +853,2198 @@ static Program *p_new(uint8_t *hash)
 }
 
 /*
- * NAME:	Program->del()
- * DESCRIPTION:	remove a program
+ * NAME:	Program->del()
+ * DESCRIPTION:	remove a program
+ */
+static void p_del(Program *p)
+{
+    if (--(p->refCount) == 0) {
+	h_remove(&programs, *(uint64_t *) p->hash, &p_eq, p->hash);
+	e_unload(p, &programSlab);
+    }
+}
+
+/*
+ * NAME:	Object->hash()
+ * DESCRIPTION:	hash object index and instance
+ */
+static uint64_t o_hash(uint64_t index, uint64_t instance)
+{
+    uint64_t h;
+
+    h = (index * 0x9e3779b97f4a7c15ULL) ^ instance;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+/*
+ * NAME:	Object->eq()
+ * DESCRIPTION:	compare object with index and instance
+ */
+static bool o_eq(void *entry, const void *key)
+{
+    return (((Object *) entry)->index == ((uint64_t *) key)[0] &&
+	    ((Object *) entry)->instance == ((uint64_t *) key)[1]);
+}
+
+/*
+ * NAME:	Object->find()
+ * DESCRIPTION:	find object
+ */
+static Object *o_find(uint64_t index, uint64_t instance)
+{
+    uint64_t key[2];
+
+    key[0] = index;
+    key[1] = instance;
+    return (Object *) h_find(&objects, o_hash(index, instance), &o_eq, key);
+}
+
+/*
+ * NAME:	Object->new()
+ * DESCRIPTION:	create a new cache entry
+ */
+static Object *o_new(uint64_t index, uint64_t instance)
+{
+    Object *o;
+
+    o = s_alloc(&objectSlab);
+    if (o == NULL) {
+	return NULL;
+    }
+    o->index = index;
+    o->instance = instance;
+    o->program = NULL;
+    o->calls = 0;
+    h_insert(&objects, o_hash(index, instance), o);
+
+    return o;
+}
+
+/*
+ * NAME:	Object->del()
+ * DESCRIPTION:	remove a cache entry
+ */
+static void o_del(Object *o)
+{
+    uint64_t key[2];
+
+    if (o->program != NULL) {
+	p_del(o->program);
+    }
+    key[0] = o->index;
+    key[1] = o->instance;
+    h_remove(&objects, o_hash(o->index, o->instance), &o_eq, key);
+    e_retire(o, &objectSlab);
+}
+
+/*
+ * NAME:	Object->get()
+ * DESCRIPTION:	find an object, or create it if it doesn't exist yet
+ */
+static Object *o_get(uint64_t index, uint64_t instance, bool entered)
+{
+    Object *o;
+
+    o = o_find(index, instance);
+    if (o == NULL) {
+	if (entered) {
+	    /* not found without locking, try again with lock */
+	    MUTEX_LOCK(&lock);
+	    o = o_find(index, instance);
+	}
+	if (o == NULL) {
+	    o = o_new(index, instance);
+	}
+	if (entered) {
+	    MUTEX_UNLOCK(&lock);
+	}
+    }
+
+    return o;
+}
+
+
+# define CONFIG_SIZE	1000
+
+static char configDir[CONFIG_SIZE];
+static int flags;
+static void **vm;
+static uint8_t intInheritSize;
+static bool active;
+static bool initialized;	/* locks and tables exist */
+static uint32_t threshold = 1;	/* # calls before an object is compiled */
+static uint32_t workers = 1;	/* # compile workers */
+static uint32_t cacheSize;	/* cache size in megabytes, 0 for no limit */
+static uint32_t ringSize;	/* ring size in kilobytes, 0 for pipes */
+static uint32_t optLevel;	/* optimization level, 0 for size */
+static uint32_t hotThreshold;	/* # calls before optimizing, 0 for never */
+static uint32_t hotOptLevel = 3; /* optimization level of hot programs */
+static uint32_t profile;	/* count branches to optimize hot programs */
+static uint32_t nPreload;	/* # programs to preload */
+static volatile uint32_t unclaimed; /* # preloaded programs not yet used */
+static volatile bool preloading; /* objects may match preloaded programs */
+
+/*
+ * Settings are read from jit.conf in the configuration directory, one
+ * "name = value" per line.  Empty lines and lines starting with # are
+ * ignored.
+ */
+typedef struct {
+    const char *name;		/* setting name */
+    uint32_t *value;		/* setting value */
+    uint32_t min, max;		/* valid range */
+} Setting;
+
+static Setting settings[] = {
+    { "threshold", &threshold, 1, UINT32_MAX },
+    { "workers", &workers, 1, 256 },
+    { "cache_size", &cacheSize, 0, UINT32_MAX },
+    { "ring_size", &ringSize, 0, 1048576 },
+    { "opt_level", &optLevel, 0, 3 },
+    { "hot_threshold", &hotThreshold, 0, UINT32_MAX },
+    { "hot_opt_level", &hotOptLevel, 0, 3 },
+    { "profile", &profile, 0, 1 },
+    { NULL, NULL, 0, 0 }
+};
+
+/*
+ * NAME:	Config->read()
+ * DESCRIPTION:	read settings from the configuration file
+ */
+static void c_read(const char *dir)
+{
+    char path[2 * CONFIG_SIZE], line[256], name[64];
+    unsigned long value;
+    FILE *fp;
+    Setting *s;
+    int n;
+
+    sprintf(path, "%s/jit.conf", dir);
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+	return;		/* use defaults */
+    }
+
+    for (n = 1; fgets(line, sizeof(line), fp) != NULL; n++) {
+	if (sscanf(line, " %63[^ \t=#] = %lu", name, &value) != 2) {
+	    if (sscanf(line, " %1[^#]", name) == 1) {
+		fprintf(stderr, "JIT %s, line %d: syntax error\n", path, n);
+	    }
+	    continue;
+	}
+	for (s = settings; s->name != NULL; s++) {
+	    if (strcmp(s->name, name) == 0) {
+		break;
+	    }
+	}
+	if (s->name == NULL) {
+	    fprintf(stderr, "JIT %s, line %d: unknown setting %s\n", path, n,
+		    name);
+	} else if (value < s->min || value > s->max) {
+	    fprintf(stderr, "JIT %s, line %d: %s out of range\n", path, n,
+		    name);
+	} else {
+	    *s->value = (uint32_t) value;
+	}
+    }
+
+    fclose(fp);
+}
+
+/*
+ * NAME:	filename()
+ * DESCRIPTION:	hash to filename
+ */
+static void filename(char *buffer, uint8_t *hash)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	*buffer++ = hex[hash[i] >> 4];
+	*buffer++ = hex[hash[i] & 0xf];
+    }
+    *buffer = '\0';
+}
+
+/*
+ * NAME:	md5hash()
+ * DESCRIPTION:	compute MD5 hash over a number of segments
+ */
+static void md5hash(uint8_t *hash, struct iovec *iov, int n)
+{
+    uint32_t digest[4];
+    unsigned char tmp[64];
+    unsigned char *buffer;
+    size_t size, sz, len, fill;
+
+    /*
+     * compute MD5 hash
+     */
+    (*lpc_md5_start)(digest);
+    size = fill = 0;
+    while (--n >= 0) {
+	buffer = (unsigned char *) iov->iov_base;
+	sz = (iov++)->iov_len;
+	size += sz;
+
+	if (fill != 0) {
+	    /* complete partial block */
+	    len = (sz < 64 - fill) ? sz : 64 - fill;
+	    memcpy(tmp + fill, buffer, len);
+	    buffer += len;
+	    sz -= len;
+	    fill += len;
+	    if (fill < 64) {
+		continue;
+	    }
+	    (*lpc_md5_block)(digest, tmp);
+	    fill = 0;
+	}
+	for (; sz >= 64; buffer += 64, sz -= 64) {
+	    (*lpc_md5_block)(digest, buffer);
+	}
+	memcpy(tmp, buffer, sz);
+	fill = sz;
+    }
+    (*lpc_md5_end)(hash, digest, tmp, (uint16_t) fill, size);
+}
+
+/*
+ * NAME:	writev_all()
+ * DESCRIPTION:	write all segments to a file
+ */
+static bool writev_all(int fd, struct iovec *iov, int n)
+{
+# ifndef WIN32
+    ssize_t sz;
+
+    while (n != 0) {
+	sz = writev(fd, iov, n);
+	if (sz < 0) {
+	    return false;
+	}
+	/* skip what was written */
+	while (n != 0 && (size_t) sz >= iov->iov_len) {
+	    sz -= (iov++)->iov_len;
+	    --n;
+	}
+	if (n != 0) {
+	    iov->iov_base = (char *) iov->iov_base + sz;
+	    iov->iov_len -= sz;
+	}
+    }
+# else
+    for (; n != 0; iov++, --n) {
+	if (write(fd, iov->iov_base, (unsigned int) iov->iov_len) !=
+							    iov->iov_len) {
+	    return false;
+	}
+    }
+# endif
+    return true;
+}
+
+/*
+ * The files in the cache are tracked per program hash, in order of last use.
+ * The state of each program in the cache is kept in an index file, which is
+ * mapped into memory and rebuilt by scanning the cache when it is missing or
+ * invalid.  When the cache grows beyond its size limit, the least recently
+ * used programs are removed, except for those still in use by any object.
+ * Shared objects built with other compiler settings than the current ones
+ * are not reused.  The disk cache and its index are only changed with the
+ * lock held.
+ */
+# define INDEX_MAGIC	0x4a495449	/* "JITI" */
+# define INDEX_VERSION	2		/* index layout version */
+# define INDEX_INIT	1024		/* initial # index records */
+# define INDEX_SPARE	16		/* # unused records kept in reserve */
+
+# define DISK_BYTECODE	0x01		/* bytecode present */
+# define DISK_BUILT	0x02		/* shared object built */
+# define DISK_FAILED	0x04		/* compilation failed */
+# define DISK_OPTIMIZED	0x08		/* optimized shared object built */
+# define DISK_OPT_FAILED 0x10		/* optimization failed */
+
+# define SETTINGS_PROFILE 0x10		/* baseline tier counts branches */
+# define SETTINGS_KNOWN	0x80000000	/* compiler settings recorded */
+
+typedef struct {
+    uint32_t magic;		/* INDEX_MAGIC */
+    uint32_t version;		/* INDEX_VERSION */
+    uint32_t jitVersion;	/* JIT_VERSION */
+    uint32_t unused;		/* padding */
+    uint64_t nRecords;		/* # records */
+} IndexHeader;
+
+typedef struct {
+    uint8_t hash[16];		/* program hash */
+    uint32_t state;		/* program state, 0 if unused */
+    uint32_t settings;		/* compiler settings of its shared objects */
+    uint64_t size;		/* size of all files */
+    int64_t lastUse;		/* time of last use */
+} IndexRecord;
+
+typedef struct DiskEntry {
+    uint8_t hash[16];		/* program hash */
+    uint64_t record;		/* index record */
+    bool pending;		/* compilation requested */
+    uint64_t requested;		/* time of compile request, or 0 */
+    struct DiskEntry *prev;	/* previous in LRU list */
+    struct DiskEntry *next;	/* next in LRU list */
+} DiskEntry;
+
+static const char *suffixes[] = {
+    "", ".ll", ".bc", DLL_EXT, ".err", ".prof", ".2.ll", ".2.bc", ".2" DLL_EXT,
+    ".2.err", NULL
+};
+static const char *built[][4] = {	/* files of a compiled tier */
+    { ".ll", ".bc", DLL_EXT, NULL }, { ".2.ll", ".2.bc", ".2" DLL_EXT, NULL }
+};
+static const char *errors[][2] = {	/* files of a failed tier */
+    { ".err", NULL }, { ".2.err", NULL }
+};
+static Slab diskSlab = SLAB_INIT(DiskEntry);
+static Hash disk;			/* disk entries by hash */
+static DiskEntry *lru, *mru;		/* least and most recently used */
+static uint64_t diskSize;		/* size of cache */
+static uint32_t diskSettings;		/* current compiler settings */
+static IndexHeader *diskIndex;		/* mapped index */
+static IndexRecord *records;		/* index records */
+static int indexFd;			/* index file descriptor */
+# ifdef WIN32
+static HANDLE indexMap;			/* index file mapping */
+# endif
+static uint64_t *freeRecords;		/* unused index records */
+static uint64_t nFree;			/* # unused index records */
+static uint8_t dirs[32];		/* cache directories created */
+
+/*
+ * NAME:	Disk->eq()
+ * DESCRIPTION:	compare disk entry with hash
+ */
+static bool d_eq(void *entry, const void *key)
+{
+    return (memcmp(((DiskEntry *) entry)->hash, key, 16) == 0);
+}
+
+/*
+ * NAME:	Disk->path()
+ * DESCRIPTION:	construct the path of a cache file
+ */
+static void d_path(char *path, uint8_t *hash, const char *suffix)
+{
+    char file[33];
+
+    filename(file, hash);
+    sprintf(path, "%s/cache/%c%c/%s%s", configDir, file[0], file[1], file,
+	    suffix);
+}
+
+/*
+ * NAME:	Disk->files()
+ * DESCRIPTION:	determine the size of files for a program
+ */
+static uint64_t d_files(uint8_t *hash, const char **suffixes)
+{
+    char path[2 * CONFIG_SIZE];
+    struct stat st;
+    uint64_t size;
+    int i;
+
+    size = 0;
+    for (i = 0; suffixes[i] != NULL; i++) {
+	d_path(path, hash, suffixes[i]);
+	if (stat(path, &st) == 0) {
+	    size += st.st_size;
+	}
+    }
+
+    return size;
+}
+
+/*
+ * NAME:	Index->map()
+ * DESCRIPTION:	map the index file into memory with room for n records,
+ *		leaving any current mapping in place
+ */
+static IndexHeader *i_map(uint64_t n, void **handle)
+{
+    uint64_t size;
+    void *map;
+
+    size = sizeof(IndexHeader) + n * sizeof(IndexRecord);
+# ifndef WIN32
+    if (ftruncate(indexFd, size) < 0) {
+	return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+    if (map == MAP_FAILED) {
+	return NULL;
+    }
+    *handle = NULL;
+# else
+    *handle = CreateFileMapping((HANDLE) _get_osfhandle(indexFd), NULL,
+				PAGE_READWRITE, (DWORD) (size >> 32),
+				(DWORD) size, NULL);
+    if (*handle == NULL) {
+	return NULL;
+    }
+    map = MapViewOfFile((HANDLE) *handle, FILE_MAP_WRITE, 0, 0,
+			(SIZE_T) size);
+    if (map == NULL) {
+	CloseHandle((HANDLE) *handle);
+	return NULL;
+    }
+# endif
+    return (IndexHeader *) map;
+}
+
+/*
+ * NAME:	Index->unmap()
+ * DESCRIPTION:	remove a mapping of the index file with room for n records
+ */
+static void i_unmap(IndexHeader *index, uint64_t n, void *handle)
+{
+# ifndef WIN32
+    munmap(index, sizeof(IndexHeader) + n * sizeof(IndexRecord));
+# else
+    UnmapViewOfFile(index);
+    CloseHandle((HANDLE) handle);
+# endif
+}
+
+/*
+ * NAME:	Index->grow()
+ * DESCRIPTION:	make room for n records in the index; the file is extended
+ *		and mapped anew without the lock, which is only held to switch
+ *		over to the new mapping (called during initialization, or by
+ *		the writer thread)
+ */
+static bool i_grow(uint64_t n)
+{
+    IndexHeader *index, *old;
+    uint64_t *list, i;
+    void *handle, *oldHandle;
+
+    list = malloc(n * sizeof(uint64_t));
+    if (list == NULL) {
+	return false;
+    }
+    index = i_map(n, &handle);
+    if (index == NULL) {
+	free(list);
+	return false;
+    }
+
+    oldHandle = NULL;
+    MUTEX_LOCK(&lock); {
+	if (nFree != 0) {
+	    memcpy(list, freeRecords, nFree * sizeof(uint64_t));
+	}
+	free(freeRecords);
+	freeRecords = list;
+
+	i = (diskIndex != NULL) ? diskIndex->nRecords : 0;
+	index->magic = INDEX_MAGIC;
+	index->version = INDEX_VERSION;
+	index->jitVersion = JIT_VERSION;
+	index->nRecords = n;
+
+	/* new records are unused */
+	while (n > i) {
+	    freeRecords[nFree++] = --n;
+	}
+
+	/* switch mappings */
+	old = diskIndex;
+	diskIndex = index;
+	records = (IndexRecord *) (index + 1);
+# ifdef WIN32
+	oldHandle = indexMap;
+	indexMap = (HANDLE) handle;
+# endif
+    } MUTEX_UNLOCK(&lock);
+
+    if (old != NULL) {
+	i_unmap(old, i, oldHandle);
+    }
+    return true;
+}
+
+/*
+ * NAME:	Index->reserve()
+ * DESCRIPTION:	make sure that the index has unused records, before they
+ *		are needed with the lock held (called by the writer thread)
+ */
+static void i_reserve(void)
+{
+    uint64_t n;
+
+    MUTEX_LOCK(&lock); {
+	n = (nFree < INDEX_SPARE) ? diskIndex->nRecords : 0;
+    } MUTEX_UNLOCK(&lock);
+    if (n != 0) {
+	i_grow(n << 1);
+    }
+}
+
+/*
+ * NAME:	Disk->find()
+ * DESCRIPTION:	find the disk entry for a program
+ */
+static DiskEntry *d_find(uint8_t *hash)
+{
+    return (DiskEntry *) h_find(&disk, *(uint64_t *) hash, &d_eq, hash);
+}
+
+/*
+ * NAME:	Disk->unlink()
+ * DESCRIPTION:	remove an entry from the LRU list
+ */
+static void d_unlink(DiskEntry *d)
+{
+    if (d->prev != NULL) {
+	d->prev->next = d->next;
+    } else {
+	lru = d->next;
+    }
+    if (d->next != NULL) {
+	d->next->prev = d->prev;
+    } else {
+	mru = d->prev;
+    }
+}
+
+/*
+ * NAME:	Disk->add()
+ * DESCRIPTION:	add an entry for an index record
+ */
+static DiskEntry *d_add(uint64_t record)
+{
+    DiskEntry *d;
+
+    d = s_alloc(&diskSlab);
+    if (d == NULL) {
+	return NULL;
+    }
+    memcpy(d->hash, records[record].hash, 16);
+    d->record = record;
+    d->pending = false;
+    d->requested = 0;
+    d->prev = mru;
+    d->next = NULL;
+    if (mru != NULL) {
+	mru->next = d;
+    } else {
+	lru = d;
+    }
+    mru = d;
+    h_insert(&disk, *(uint64_t *) d->hash, d);
+    diskSize += records[record].size;
+
+    return d;
+}
+
+/*
+ * NAME:	Disk->settings()
+ * DESCRIPTION:	return the compiler settings that shared objects are built
+ *		with
+ */
+static uint32_t d_settings(void)
+{
+    uint32_t settings;
+
+    settings = SETTINGS_KNOWN | optLevel | (hotOptLevel << 2);
+    if (profile && hotThreshold != 0) {
+	settings |= SETTINGS_PROFILE;
+    }
+    return settings;
+}
+
+/*
+ * NAME:	Disk->use()
+ * DESCRIPTION:	record the use of a program in the cache, creating a new
+ *		entry if needed
+ */
+static DiskEntry *d_use(uint8_t *hash, time_t lastUse)
+{
+    DiskEntry *d;
+    IndexRecord *r;
+
+    d = d_find(hash);
+    if (d == NULL) {
+	if (diskIndex == NULL || nFree == 0) {
+	    return NULL;	/* the writer thread grows the index */
+	}
+	r = &records[freeRecords[--nFree]];
+	memcpy(r->hash, hash, 16);
+	r->size = 0;
+	r->lastUse = lastUse;
+	r->state = 0;
+	r->settings = diskSettings;
+	d = d_add(r - records);
+	if (d == NULL) {
+	    nFree++;	/* give the record back */
+	}
+	return d;
+    }
+
+    /* make most recently used */
+    records[d->record].lastUse = lastUse;
+    if (d != mru) {
+	d_unlink(d);
+	d->prev = mru;
+	d->next = NULL;
+	mru->next = d;
+	mru = d;
+    }
+    return d;
+}
+
+/*
+ * NAME:	Disk->size()
+ * DESCRIPTION:	change the size of a program in the cache
+ */
+static void d_size(DiskEntry *d, uint64_t size)
+{
+    diskSize += size - records[d->record].size;
+    records[d->record].size = size;
+}
+
+/*
+ * NAME:	Disk->evict()
+ * DESCRIPTION:	select least recently used programs to remove from the
+ *		cache, until it fits its limit
+ */
+static int d_evict(uint8_t (*hashes)[16], int max)
+{
+    DiskEntry *d, *next;
+    uint64_t limit;
+    int n;
+
+    limit = (uint64_t) cacheSize << 20;
+    for (d = lru, n = 0; d != NULL && diskSize > limit && n < max; d = next) {
+	next = d->next;
+	if (p_find(d->hash) == NULL) {
+	    memcpy(hashes[n++], d->hash, 16);
+	    diskSize -= records[d->record].size;
+	    records[d->record].state = 0;
+	    freeRecords[nFree++] = d->record;
+	    d_unlink(d);
+	    h_remove(&disk, *(uint64_t *) d->hash, &d_eq, d->hash);
+	    e_retire(d, &diskSlab);
+	}
+    }
+    ATOMIC_ADD64(&stats[STAT_EVICTED], n);
+
+    return n;
+}
+
+/*
+ * NAME:	Disk->trim()
+ * DESCRIPTION:	remove programs from the cache while it is too large
+ */
+static void d_trim(void)
+{
+    uint8_t hashes[64][16];
+    char path[2 * CONFIG_SIZE];
+    int n, i, j;
+
+    if (cacheSize == 0) {
+	return;
+    }
+
+    do {
+	MUTEX_LOCK(&lock); {
+	    n = d_evict(hashes, 64);
+	} MUTEX_UNLOCK(&lock);
+
+	for (i = 0; i < n; i++) {
+	    for (j = 0; suffixes[j] != NULL; j++) {
+		d_path(path, hashes[i], suffixes[j]);
+		unlink(path);
+	    }
+	}
+    } while (n == 64);
+}
+
+/*
+ * NAME:	Disk->mkdir()
+ * DESCRIPTION:	create the cache directory for a program, once
+ */
+static void d_mkdir(uint8_t *hash)
+{
+    char path[2 * CONFIG_SIZE];
+
+    if (!(dirs[hash[0] >> 3] & (1 << (hash[0] & 7)))) {
+	sprintf(path, "%s/cache/%02x", configDir, hash[0]);
+	mkdir(path, 0750);
+	dirs[hash[0] >> 3] |= 1 << (hash[0] & 7);
+    }
+}
+
+/*
+ * NAME:	Disk->hex()
+ * DESCRIPTION:	convert a filename to a hash, return false if not valid
+ */
+static bool d_hex(const char *file, uint8_t *hash)
+{
+    int i, c, x;
+
+    for (i = 0; i < 32; i++) {
+	c = file[i];
+	if (c >= '0' && c <= '9') {
+	    x = c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+	    x = c - 'a' + 10;
+	} else {
+	    return false;
+	}
+	hash[i >> 1] = (i & 1) ? hash[i >> 1] | x : x << 4;
+    }
+
+    return (file[32] == '\0' || file[32] == '.');
+}
+
+/*
+ * NAME:	Disk->cmp()
+ * DESCRIPTION:	order index records by time of last use
+ */
+static int d_cmp(const void *a, const void *b)
+{
+    int64_t ta, tb;
+
+    ta = records[*(uint64_t *) a].lastUse;
+    tb = records[*(uint64_t *) b].lastUse;
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+/*
+ * NAME:	Disk->scan()
+ * DESCRIPTION:	add the programs in the cache to a new index
+ */
+static void d_scan(void)
+{
+    char path[2 * CONFIG_SIZE];
+    uint8_t hash[16];
+    struct stat st;
+    IndexRecord *r;
+    int dir;
+# ifndef WIN32
+    DIR *d;
+    struct dirent *de;
+# else
+    HANDLE d;
+    WIN32_FIND_DATAA de;
+# endif
+
+    for (dir = 0; dir < 256; dir++) {
+# ifndef WIN32
+	sprintf(path, "%s/cache/%02x", configDir, dir);
+	d = opendir(path);
+	if (d == NULL) {
+	    continue;
+	}
+	while ((de = readdir(d)) != NULL) {
+	    if (strlen(de->d_name) == 32 && d_hex(de->d_name, hash)) {
+# else
+	sprintf(path, "%s/cache/%02x/*", configDir, dir);
+	d = FindFirstFileA(path, &de);
+	if (d == INVALID_HANDLE_VALUE) {
+	    continue;
+	}
+	do {
+	    if (strlen(de.cFileName) == 32 && d_hex(de.cFileName, hash)) {
+# endif
+		/* the bytecode file marks a program */
+		d_path(path, hash, "");
+		if (stat(path, &st) != 0) {
+		    continue;
+		}
+		if (nFree == 0 && !i_grow(diskIndex->nRecords << 1)) {
+		    break;
+		}
+		r = &records[freeRecords[--nFree]];
+		memcpy(r->hash, hash, 16);
+		r->state = DISK_BYTECODE;
+		r->settings = 0;	/* unknown */
+		d_path(path, hash, DLL_EXT);
+		if (access(path, 0) == 0) {
+		    r->state |= DISK_BUILT;
+		}
+		d_path(path, hash, ".2" DLL_EXT);
+		if (access(path, 0) == 0) {
+		    r->state |= DISK_OPTIMIZED;
+		}
+		r->size = d_files(hash, suffixes);
+		r->lastUse = st.st_mtime;
+	    }
+# ifndef WIN32
+	}
+	closedir(d);
+# else
+	} while (FindNextFileA(d, &de));
+	FindClose(d);
+# endif
+    }
+}
+
+/*
+ * NAME:	Disk->load()
+ * DESCRIPTION:	open the cache index, rebuilding it if needed
+ */
+static bool d_load(void)
+{
+    char path[2 * CONFIG_SIZE];
+    IndexHeader header;
+    struct stat st;
+    uint64_t *used, nUsed, i;
+    void *handle;
+
+    sprintf(path, "%s/cache", configDir);
+    mkdir(path, 0750);
+    sprintf(path, "%s/cache/index", configDir);
+    indexFd = open(path, O_CREAT | O_RDWR | O_BINARY, 0640);
+    if (indexFd < 0) {
+	return false;
+    }
+
+    if (fstat(indexFd, &st) == 0 && read(indexFd, &header,
+					 sizeof(IndexHeader)) ==
+							sizeof(IndexHeader) &&
+	header.magic == INDEX_MAGIC && header.version == INDEX_VERSION &&
+	header.nRecords != 0 &&
+	(uint64_t) st.st_size == sizeof(IndexHeader) +
+				 header.nRecords * sizeof(IndexRecord)) {
+	/*
+	 * use existing index
+	 */
+	freeRecords = malloc(header.nRecords * sizeof(uint64_t));
+	if (freeRecords == NULL) {
+	    return false;
+	}
+	diskIndex = i_map(header.nRecords, &handle);
+	if (diskIndex == NULL) {
+	    return false;
+	}
+# ifdef WIN32
+	indexMap = (HANDLE) handle;
+# endif
+	records = (IndexRecord *) (diskIndex + 1);
+    } else {
+	/*
+	 * rebuild index
+	 */
+	if (ftruncate(indexFd, 0) < 0 || !i_grow(INDEX_INIT)) {
+	    return false;
+	}
+	d_scan();
+    }
+
+    /*
+     * add entries in order of last use
+     */
+    used = malloc(diskIndex->nRecords * sizeof(uint64_t));
+    if (used == NULL) {
+	return false;
+    }
+    nFree = nUsed = 0;
+    diskSettings = d_settings();
+    for (i = diskIndex->nRecords; i != 0; ) {
+	if (diskIndex->jitVersion != JIT_VERSION) {
+	    /* give failed programs another chance with a new compiler */
+	    records[i - 1].state &= ~(DISK_FAILED | DISK_OPT_FAILED);
+	}
+	if (records[i - 1].settings != diskSettings) {
+	    /* rebuild with the current settings */
+	    records[i - 1].state &= ~(DISK_BUILT | DISK_FAILED |
+				      DISK_OPTIMIZED | DISK_OPT_FAILED);
+	    records[i - 1].settings = diskSettings;
+	}
+	if (records[--i].state != 0) {
+	    used[nUsed++] = i;
+	} else {
+	    freeRecords[nFree++] = i;
+	}
+    }
+    qsort(used, nUsed, sizeof(uint64_t), &d_cmp);
+    for (i = 0; i < nUsed; i++) {
+	if (d_add(used[i]) == NULL) {
+	    /* forget what cannot be tracked */
+	    records[used[i]].state = 0;
+	    freeRecords[nFree++] = used[i];
+	}
+    }
+    free(used);
+    diskIndex->jitVersion = JIT_VERSION;
+
+    return true;
+}
+
+/*
+ * NAME:	Disk->close()
+ * DESCRIPTION:	close the cache index
+ */
+static void d_close(void)
+{
+# ifndef WIN32
+    i_unmap(diskIndex, diskIndex->nRecords, NULL);
+# else
+    i_unmap(diskIndex, diskIndex->nRecords, indexMap);
+# endif
+    close(indexFd);
+}
+
+/*
+ * The programs loaded at shutdown are listed in cache/preload.  On startup,
+ * their shared objects are loaded in the background, and claimed by the
+ * first object that turns out to have the same program.  As long as
+ * preloaded programs remain unclaimed, the objects that had them at
+ * shutdown are submitted right away, regardless of how hot they are, to
+ * find out whether they still match.
+ */
+# define PRELOAD_MISSES	4	/* # unmatched objects per preload */
+
+typedef struct {
+    uint8_t hash[16];		/* program hash */
+    Handle handle;		/* dll handle */
+    LPC_function *functions;	/* function table */
+    uint32_t tier;		/* tier of shared object */
+} Preload;
+
+typedef struct {
+    uint8_t hash[16];		/* program hash */
+    uint64_t index;		/* object that had the program */
+    uint64_t instance;		/* instance of that object */
+} PreloadRecord;
+
+static Slab preloadSlab = SLAB_INIT(Preload);
+static Hash preloads;			/* preloaded programs by hash */
+static PreloadRecord *preloadList;	/* programs to preload, by object */
+static uint64_t preloadMisses;		/* # objects not matched */
+static volatile bool pstop;		/* stop preloading */
+
+/*
+ * NAME:	Preload->eq()
+ * DESCRIPTION:	compare preloaded program with hash
+ */
+static bool pl_eq(void *entry, const void *key)
+{
+    return (memcmp(((Preload *) entry)->hash, key, 16) == 0);
+}
+
+/*
+ * NAME:	Preload->find()
+ * DESCRIPTION:	find a preloaded program
+ */
+static Preload *pl_find(uint8_t *hash)
+{
+    return (Preload *) h_find(&preloads, *(uint64_t *) hash, &pl_eq, hash);
+}
+
+/*
+ * NAME:	Preload->cmp()
+ * DESCRIPTION:	compare the objects of two preload records
+ */
+static int pl_cmp(const void *a, const void *b)
+{
+    const PreloadRecord *pa, *pb;
+
+    pa = (const PreloadRecord *) a;
+    pb = (const PreloadRecord *) b;
+    if (pa->index != pb->index) {
+	return (pa->index < pb->index) ? -1 : 1;
+    }
+    if (pa->instance != pb->instance) {
+	return (pa->instance < pb->instance) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * NAME:	Preload->object()
+ * DESCRIPTION:	check whether an object had a program on the preload list
+ */
+static bool pl_object(uint64_t index, uint64_t instance)
+{
+    PreloadRecord key;
+
+    key.index = index;
+    key.instance = instance;
+    return (bsearch(&key, preloadList, nPreload, sizeof(PreloadRecord),
+		    &pl_cmp) != NULL);
+}
+
+/*
+ * NAME:	Preload->done()
+ * DESCRIPTION:	one program less to preload, stop preloading when all have
+ *		been dealt with
+ */
+static void pl_done(void)
+{
+    if (--unclaimed == 0) {
+	preloading = false;
+    }
+}
+
+/*
+ * NAME:	Preload->del()
+ * DESCRIPTION:	remove a preloaded program
+ */
+static void pl_del(Preload *pl)
+{
+    h_remove(&preloads, *(uint64_t *) pl->hash, &pl_eq, pl->hash);
+    e_retire(pl, &preloadSlab);
+    pl_done();
+}
+
+/*
+ * NAME:	Preload->claim()
+ * DESCRIPTION:	give a program the preloaded shared object with the same
+ *		hash, if there is one
+ */
+static void pl_claim(Program *p, Preload *pl)
+{
+    STAT(STAT_CLAIMED);
+    if (p->functions == NULL) {
+	p->handle = pl->handle;
+	p->tier = pl->tier;
+	ATOMIC_STORE(&p->functions, pl->functions);
+    } else {
+	e_unload(pl->handle, NULL);
+    }
+    pl_del(pl);
+}
+
+/*
+ * NAME:	Preload->miss()
+ * DESCRIPTION:	an object did not match any preloaded program
+ */
+static void pl_miss(void)
+{
+    if (++preloadMisses >= (uint64_t) nPreload * PRELOAD_MISSES) {
+	preloading = false;
+    }
+}
+
+/*
+ * NAME:	Preload->thread()
+ * DESCRIPTION:	load the shared objects of programs listed for preloading
+ */
+static void *pl_thread(void *arg)
+{
+    char module[2 * CONFIG_SIZE];
+    DiskEntry *d;
+    Program *p;
+    Preload *pl;
+    Handle handle;
+    LPC_function *functions;
+    uint32_t i, state;
+
+    for (i = 0; i < nPreload && !pstop; i++) {
+	MUTEX_LOCK(&lock); {
+	    d = d_find(preloadList[i].hash);
+	    state = (d != NULL) ? records[d->record].state : 0;
+	} MUTEX_UNLOCK(&lock);
+
+	handle = NULL;
+	functions = NULL;
+	if (state & (DISK_BUILT | DISK_OPTIMIZED)) {
+	    /* prefer the optimized tier */
+	    d_path(module, preloadList[i].hash,
+		   (state & DISK_OPTIMIZED) ? ".2" DLL_EXT : DLL_EXT);
+	    handle = DLL_OPEN(module);
+	    if (handle != NULL) {
+		functions = (LPC_function *) DLL_SYM(handle, "functions");
+	    }
+	}
+
+	MUTEX_LOCK(&lock); {
+	    p = p_find(preloadList[i].hash);
+	    pl = (functions != NULL && p == NULL) ?
+		  s_alloc(&preloadSlab) : NULL;
+	    if (pl != NULL) {
+		/* keep until claimed */
+		memcpy(pl->hash, preloadList[i].hash, 16);
+		pl->handle = handle;
+		pl->functions = functions;
+		pl->tier = (state & DISK_OPTIMIZED) ? 2 : 1;
+		h_insert(&preloads, *(uint64_t *) pl->hash, pl);
+		handle = NULL;
+		STAT(STAT_PRELOADED);
+	    } else {
+		if (functions != NULL && p != NULL && p->functions == NULL) {
+		    /* already requested */
+		    p->handle = handle;
+		    p->tier = (state & DISK_OPTIMIZED) ? 2 : 1;
+		    ATOMIC_STORE(&p->functions, functions);
+		    handle = NULL;
+		    STAT(STAT_PRELOADED);
+		}
+		pl_done();
+	    }
+	} MUTEX_UNLOCK(&lock);
+
+	if (handle != NULL) {
+	    DLL_CLOSE(handle);
+	}
+    }
+
+    return NULL;
+}
+
+/*
+ * NAME:	Preload->list()
+ * DESCRIPTION:	read the list of programs to preload
+ */
+static void pl_list(void)
+{
+    char path[2 * CONFIG_SIZE];
+    struct stat st;
+    int fd;
+
+    sprintf(path, "%s/cache/preload", configDir);
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+	return;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(PreloadRecord) &&
+	st.st_size % sizeof(PreloadRecord) == 0 &&
+	(preloadList = malloc(st.st_size)) != NULL) {
+	if (read(fd, preloadList, st.st_size) == st.st_size) {
+	    nPreload = st.st_size / sizeof(PreloadRecord);
+	    qsort(preloadList, nPreload, sizeof(PreloadRecord), &pl_cmp);
+	    unclaimed = nPreload;
+	    preloading = true;
+	}
+    }
+    close(fd);
+}
+
+/*
+ * NAME:	Preload->add()
+ * DESCRIPTION:	add a loaded program to a list
+ */
+static void pl_add(void *entry, void *arg)
+{
+    Program *p;
+    PreloadRecord pr;
+
+    p = (Program *) entry;
+    if (p->functions != NULL) {
+	memcpy(pr.hash, p->hash, 16);
+	pr.index = p->index;
+	pr.instance = p->instance;
+	fwrite(&pr, sizeof(PreloadRecord), 1, (FILE *) arg);
+    }
+}
+
+/*
+ * NAME:	Preload->save()
+ * DESCRIPTION:	list the programs currently loaded, for the next startup
+ */
+static void pl_save(void)
+{
+    char path[2 * CONFIG_SIZE], tmp[2 * CONFIG_SIZE];
+    FILE *fp;
+    bool ok;
+
+    sprintf(path, "%s/cache/preload", configDir);
+    sprintf(tmp, "%s/cache/preload.tmp", configDir);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+	return;
+    }
+    MUTEX_LOCK(&lock); {
+	h_each(&programs, &pl_add, fp);
+    } MUTEX_UNLOCK(&lock);
+    ok = (fclose(fp) == 0);
+
+    unlink(path);
+    if (!ok || rename(tmp, path) != 0) {
+	unlink(tmp);
+    }
+}
+
+/*
+ * NAME:	Preload->close()
+ * DESCRIPTION:	unload a preloaded program that was never claimed
+ */
+static void pl_close(void *entry, void *arg)
+{
+    DLL_CLOSE(((Preload *) entry)->handle);
+}
+
+/*
+ * Messages to and from the backend are batched in frames.  A frame that
+ * fills up is sent immediately, otherwise it is sent when the sender runs
+ * out of work.
+ */
+typedef struct {
+    JitFrame header;				/* frame header */
+    uint8_t data[JIT_FRAME_MAX - sizeof(JitFrame)]; /* records */
+} Frame;
+
+/*
+ * NAME:	Frame->init()
+ * DESCRIPTION:	initialize an empty frame
+ */
+static void f_init(Frame *f)
+{
+    f->header.size = sizeof(JitFrame);
+    f->header.version = JIT_PROTOCOL;
+    f->header.nRecords = 0;
+}
+
+/*
+ * NAME:	Frame->flush()
+ * DESCRIPTION:	send a frame, if it holds any records
+ */
+static void f_flush(Frame *f, int (*send)(const void*, int))
+{
+    if (f->header.nRecords != 0) {
+	(*send)(f, f->header.size);
+	STAT(STAT_FRAMES);
+	f_init(f);
+    }
+}
+
+/*
+ * NAME:	Frame->take()
+ * DESCRIPTION:	move the records of a frame to another frame
+ */
+static void f_take(Frame *to, Frame *from)
+{
+    memcpy(to, from, from->header.size);
+    f_init(from);
+}
+
+/*
+ * NAME:	Frame->full()
+ * DESCRIPTION:	check if a record of the given size no longer fits
+ */
+static bool f_full(Frame *f, int size)
+{
+    return (f->header.size + sizeof(JitRecord) + size > JIT_FRAME_MAX ||
+	    f->header.nRecords == UINT8_MAX);
+}
+
+/*
+ * NAME:	Frame->add()
+ * DESCRIPTION:	add a record to a frame, sending the frame first if full
+ */
+static void f_add(Frame *f, int type, const void *data, int size,
+		  int (*send)(const void*, int))
+{
+    JitRecord rec;
+
+    if (f_full(f, size)) {
+	f_flush(f, send);
+    }
+    rec.type = type;
+    rec.size = size;
+    memcpy((uint8_t *) f + f->header.size, &rec, sizeof(JitRecord));
+    memcpy((uint8_t *) f + f->header.size + sizeof(JitRecord), data, size);
+    f->header.size += sizeof(JitRecord) + size;
+    f->header.nRecords++;
+    STAT(STAT_RECORDS);
+}
+
+/*
+ * NAME:	Frame->read()
+ * DESCRIPTION:	read a frame from the backend
+ */
+static bool f_read(Frame *f)
+{
+    uint8_t *p;
+    int size, n;
+
+    for (p = (uint8_t *) f, size = sizeof(JitFrame); size != 0;
+	 p += n, size -= n) {
+	n = lpc_ext_read(p, size);
+	if (n <= 0) {
+	    return false;
+	}
+    }
+    if (f->header.size < sizeof(JitFrame) || f->header.size > JIT_FRAME_MAX) {
+	return false;
+    }
+    for (size = f->header.size - sizeof(JitFrame); size != 0;
+	 p += n, size -= n) {
+	n = lpc_ext_read(p, size);
+	if (n <= 0) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+# ifdef __linux__
+/*
+ * With a ring buffer in shared memory, the writer thread passes frames to
+ * jitcomp without a pipe, and with them the programs it has just written to
+ * the cache, so that jitcomp need not read them back.  Programs that do not
+ * fit are read from the cache as before.
+ */
+# define RING_MIN	65536	/* minimum ring size */
+
+static JitRing *ring;			/* shared ring, or NULL */
+static uint8_t *ringData;		/* ring data */
+static int ringFd;			/* shared memory */
+static int dataFd, roomFd;		/* eventfds for data and room */
+static volatile bool rstop;		/* stop waiting for room */
+
+/*
+ * NAME:	Ring->create()
+ * DESCRIPTION:	create a ring buffer to share with jitcomp
+ */
+static bool r_create(uint32_t kbytes)
+{
+    uint64_t size;
+    void *map;
+
+    size = RING_MIN;
+    while (size < (uint64_t) kbytes * 1024) {
+	size <<= 1;
+    }
+    ringFd = memfd_create("jit", 0);
+    if (ringFd < 0) {
+	return false;
+    }
+    dataFd = eventfd(0, 0);
+    roomFd = eventfd(0, 0);
+    map = MAP_FAILED;
+    if (dataFd >= 0 && roomFd >= 0 &&
+	ftruncate(ringFd, JIT_RING_DATA + size) == 0) {
+	map = mmap(NULL, JIT_RING_DATA + size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, ringFd, 0);
+    }
+    if (map == MAP_FAILED) {
+	if (dataFd >= 0) {
+	    close(dataFd);
+	}
+	if (roomFd >= 0) {
+	    close(roomFd);
+	}
+	close(ringFd);
+	return false;
+    }
+
+    ring = (JitRing *) map;
+    ring->size = size;
+    ringData = (uint8_t *) map + JIT_RING_DATA;
+    return true;
+}
+
+/*
+ * NAME:	Ring->spawned()
+ * DESCRIPTION:	jitcomp has inherited the ring, or failed to start
+ */
+static void r_spawned(bool success)
+{
+    close(ringFd);
+    if (success) {
+	/* don't pass the ring on to other processes */
+	fcntl(dataFd, F_SETFD, FD_CLOEXEC);
+	fcntl(roomFd, F_SETFD, FD_CLOEXEC);
+    } else {
+	munmap(ring, JIT_RING_DATA + ring->size);
+	close(dataFd);
+	close(roomFd);
+	ring = NULL;
+    }
+}
+
+/*
+ * NAME:	Ring->put()
+ * DESCRIPTION:	put an entry in the ring, optionally waiting for room
+ */
+static bool r_put(int type, struct iovec *iov, int n, bool wait)
+{
+    JitEntry entry, filler;
+    uint64_t head, offset, need, skip, count;
+    struct pollfd pfd;
+    uint8_t *p;
+    int i;
+
+    entry.type = type;
+    for (entry.size = 0, i = 0; i < n; i++) {
+	entry.size += iov[i].iov_len;
+    }
+    need = sizeof(JitEntry) + JIT_RING_ALIGN(entry.size);
+    if (need > ring->size / 2) {
+	return false;	/* too large */
+    }
+
+    head = ring->head;
+    offset = head & (ring->size - 1);
+    skip = (offset + need > ring->size) ? ring->size - offset : 0;
+    while (head + skip + need - ATOMIC_LOAD(&ring->tail) > ring->size) {
+	if (!wait) {
+	    return false;
+	}
+
+	/*
+	 * wait for jitcomp to make room
+	 */
+	ATOMIC_STORE(&ring->full, 1);
+	ATOMIC_FENCE();
+	if (head + skip + need - ATOMIC_LOAD(&ring->tail) <= ring->size) {
+	    break;
+	}
+	pfd.fd = roomFd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) > 0) {
+	    (void) read(roomFd, &count, sizeof(count));
+	}
+	if (!active || rstop) {
+	    return false;
+	}
+    }
+
+    if (skip != 0) {
+	/* continue at the start of the ring */
+	filler.type = JIT_ENTRY_SKIP;
+	filler.size = skip - sizeof(JitEntry);
+	memcpy(ringData + offset, &filler, sizeof(JitEntry));
+	head += skip;
+	offset = 0;
+    }
+    p = ringData + offset;
+    memcpy(p, &entry, sizeof(JitEntry));
+    p += sizeof(JitEntry);
+    for (i = 0; i < n; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+
+    /*
+     * publish, and wake up jitcomp if it sleeps
+     */
+    ATOMIC_STORE(&ring->head, head + need);
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD(&ring->sleeping)) {
+	count = 1;
+	(void) write(dataFd, &count, sizeof(count));
+    }
+    return true;
+}
+
+/*
+ * NAME:	Ring->stop()
+ * DESCRIPTION:	stop the writer thread from waiting for room
+ */
+static void r_stop(void)
+{
+    uint64_t count;
+
+    rstop = true;
+    count = 1;
+    (void) write(roomFd, &count, sizeof(count));
+}
+
+/*
+ * NAME:	Ring->close()
+ * DESCRIPTION:	unmap the ring
+ */
+static void r_close(void)
+{
+    munmap(ring, JIT_RING_DATA + ring->size);
+    close(dataFd);
+    close(roomFd);
+    ring = NULL;
+}
+# endif
+
+/*
+ * Programs to be compiled are handed to a writer thread through a bounded
+ * queue, so that the interpreter never waits for the cache directory.  When
+ * the queue is full, the request is dropped, and the object that made it
+ * forgets about the program, so it will be submitted again once the object
+ * has become hot again.  The queue also carries hotness hints
+ * for programs which are still waiting to be compiled, and requests to
+ * optimize hot programs.  At most one hint per program is queued at a time,
+ * passing on the hotness of the program when the writer gets to it, and
+ * hints never take up more than part of the queue.
+ */
+# define WRITE_QUEUE	64	/* size of the write queue */
+# define WRITE_HINTS	16	/* max # queued requests when hinting */
+
+typedef struct {
+    uint8_t hash[16];		/* program hash */
+    uint32_t hotness;		/* # calls observed */
+    uint32_t tier;		/* tier to compile */
+    unsigned char *data;	/* program data, or NULL */
+    size_t size;		/* program data size */
+} WriteRequest;
+
+static Mutex wlock;			/* write queue lock */
+static Cond wcond;			/* write queue condition */
+static WriteRequest wqueue[WRITE_QUEUE]; /* write queue */
+static unsigned int wfirst, wcount;	/* first request, # requests */
+static bool wstop;			/* stop writer thread */
+static Frame wrequests;			/* requests for the backend */
+static Frame wreplies;			/* replies to the jit thread */
+
+/*
+ * NAME:	Writer->put()
+ * DESCRIPTION:	put a request in the write queue, return false if it holds
+ *		max requests already
+ */
+static bool w_put(uint8_t *hash, uint32_t hotness, uint32_t tier,
+		  unsigned char *data, size_t size, unsigned int max)
+{
+    unsigned int i;
+
+    MUTEX_LOCK(&wlock);
+    if (wcount >= max) {
+	MUTEX_UNLOCK(&wlock);
+	return false;
+    }
+    i = (wfirst + wcount++) % WRITE_QUEUE;
+    memcpy(wqueue[i].hash, hash, 16);
+    wqueue[i].hotness = hotness;
+    wqueue[i].tier = tier;
+    wqueue[i].data = data;
+    wqueue[i].size = size;
+    COND_SIGNAL(&wcond);
+    MUTEX_UNLOCK(&wlock);
+
+    return true;
+}
+
+/*
+ * NAME:	Writer->add()
+ * DESCRIPTION:	add a program to the write queue, return false if dropped
+ */
+static bool w_add(uint8_t *hash, uint32_t hotness, struct iovec *iov, int n)
+{
+    unsigned char *data, *p;
+    size_t size;
+    int i;
+
+    MUTEX_LOCK(&wlock);
+    if (wcount == WRITE_QUEUE) {
+	/* full */
+	MUTEX_UNLOCK(&wlock);
+	STAT(STAT_DROPPED);
+	return false;
+    }
+    MUTEX_UNLOCK(&wlock);
+
+    for (size = 0, i = 0; i < n; i++) {
+	size += iov[i].iov_len;
+    }
+    data = malloc(size);
+    if (data == NULL) {
+	STAT(STAT_DROPPED);
+	return false;
+    }
+    for (p = data, i = 0; i < n; i++) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+	p += iov[i].iov_len;
+    }
+
+    if (w_put(hash, hotness, 1, data, size, WRITE_QUEUE)) {
+	STAT(STAT_SUBMITTED);
+	return true;
+    } else {
+	STAT(STAT_DROPPED);
+	free(data);
+	return false;
+    }
+}
+
+/*
+ * NAME:	Writer->hint()
+ * DESCRIPTION:	pass on the hotness of a program waiting to be compiled,
+ *		return false if the queue is too full
+ */
+static bool w_hint(uint8_t *hash, uint32_t hotness)
+{
+    if (w_put(hash, hotness, 1, NULL, 0, WRITE_HINTS)) {
+	STAT(STAT_HINTS);
+	return true;
+    }
+    return false;
+}
+
+/*
+ * NAME:	Writer->optimize()
+ * DESCRIPTION:	request a hot program to be compiled at the optimized tier
+ */
+static bool w_optimize(uint8_t *hash, uint32_t hotness)
+{
+    if (w_put(hash, hotness, 2, NULL, 0, WRITE_QUEUE)) {
+	STAT(STAT_OPTIMIZE);
+	return true;
+    }
+    return false;
+}
+
+/*
+ * NAME:	Writer->send()
+ * DESCRIPTION:	send a frame to the backend
+ */
+static int w_send(const void *buf, int size)
+{
+# ifdef __linux__
+    struct iovec iov;
+
+    if (ring != NULL) {
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return (r_put(JIT_ENTRY_FRAME, &iov, 1, true)) ? size : -1;
+    }
+# endif
+    return lpc_ext_write(buf, size);
+}
+
+/*
+ * NAME:	Writer->reply()
+ * DESCRIPTION:	add a reply for the jit thread, sent by the writer thread;
+ *		a full frame is sent by the caller, after releasing the lock
+ */
+static void w_reply(int type, const void *data, int size)
+{
+    Frame full;
+    bool flush;
+
+    MUTEX_LOCK(&wlock);
+    if (wreplies.header.nRecords == 0) {
+	COND_SIGNAL(&wcond);
+    }
+    flush = f_full(&wreplies, size);
+    if (flush) {
+	f_take(&full, &wreplies);
+    }
+    f_add(&wreplies, type, data, size, NULL);
+    MUTEX_UNLOCK(&wlock);
+
+    if (flush) {
+	f_flush(&full, &lpc_ext_writeback);
+    }
+}
+
+/*
+ * NAME:	Writer->request()
+ * DESCRIPTION:	add a request for the backend
+ */
+static void w_request(WriteRequest *req, bool hint)
+{
+    uint8_t data[21];
+
+    memcpy(data, req->hash, 16);
+    memcpy(data + 16, &req->hotness, 4);
+    data[20] = req->tier;
+    f_add(&wrequests, (hint) ? JIT_REC_HINT : JIT_REC_COMPILE, data, 21,
+	  &w_send);
+}
+
+/*
+ * NAME:	Writer->write()
+ * DESCRIPTION:	store a program in the cache, and pass it on to the backend
+ */
+static void w_write(WriteRequest *req)
+{
+    char path[2 * CONFIG_SIZE];
+    uint8_t hash[17];
+    DiskEntry *d;
+    struct iovec iov;
+    uint32_t state;
+    bool pending;
+    int fd;
+
+    memcpy(hash, req->hash, 16);
+    i_reserve();
+    MUTEX_LOCK(&lock); {
+	d = d_use(hash, time(NULL));
+	if (d != NULL) {
+	    state = records[d->record].state;
+	    pending = d->pending;
+	    if (!(state & (DISK_BUILT | DISK_FAILED)) && !pending) {
+		d->pending = true;
+		d->requested = st_now();
+	    }
+	} else {
+	    /* no room in index: compile without keeping track */
+	    state = 0;
+	    pending = false;
+	}
+    } MUTEX_UNLOCK(&lock);
+    if (d == NULL) {
+	STAT(STAT_UNINDEXED);
+    }
+
+    if (state & DISK_BUILT) {
+	/*
+	 * reuse existing shared object
+	 */
+	STAT(STAT_CACHE_HITS);
+	hash[16] = (state & DISK_OPTIMIZED) ? 2 : 1;
+	w_reply(JIT_REC_COMPILED, hash, 17);
+    } else if (state & DISK_FAILED) {
+	/* don't try again */
+	STAT(STAT_SKIPPED);
+    } else if (state & DISK_BYTECODE) {
+	/*
+	 * reuse existing data, compilation may already be underway
+	 */
+	w_request(req, pending);
+    } else {
+	/*
+	 * write to file
+	 */
+	d_mkdir(hash);
+	d_path(path, hash, "");
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0640);
+	if (fd >= 0) {
+	    iov.iov_base = req->data;
+	    iov.iov_len = req->size;
+	    if (writev_all(fd, &iov, 1)) {
+		STAT(STAT_CACHE_MISSES);
+		if (d != NULL) {
+		    MUTEX_LOCK(&lock); {
+			records[d->record].state |= DISK_BYTECODE;
+			d_size(d, req->size);
+		    } MUTEX_UNLOCK(&lock);
+		}
+
+		/*
+		 * inform backend
+		 */
+# ifdef __linux__
+		if (ring != NULL) {
+		    struct iovec program[2];
+
+		    program[0].iov_base = hash;
+		    program[0].iov_len = 16;
+		    program[1].iov_base = req->data;
+		    program[1].iov_len = req->size;
+		    if (r_put(JIT_ENTRY_PROGRAM, program, 2, false)) {
+			STAT(STAT_RING_PROGRAMS);
+		    }
+		}
+# endif
+		w_request(req, false);
+	    }
+	    close(fd);
+	    d_trim();
+	}
+    }
+}
+
+/*
+ * NAME:	Writer->profile()
+ * DESCRIPTION:	keep a snapshot of the branch counters of an instrumented
+ *		program for jitcomp
+ */
+static void w_profile(uint8_t *hash)
+{
+    char path[2 * CONFIG_SIZE];
+    Program *p;
+    Handle handle;
+    uint64_t **counters, *data;
+    struct iovec iov;
+    size_t n, i;
+    bool written;
+    int fd;
+
+    /* keep the shared object loaded while reading its counters */
+    MUTEX_LOCK(&lock); {
+	p = p_find(hash);
+	if (p != NULL && p->tier == 1) {
+	    handle = (Handle) p->handle;
+	    ATOMIC_INC(&p->running);
+	} else {
+	    p = NULL;
+	}
+    } MUTEX_UNLOCK(&lock);
+    if (p == NULL) {
+	return;
+    }
+
+    data = NULL;
+    n = 0;
+    counters = (uint64_t **) DLL_SYM(handle, "counters");
+    if (counters != NULL) {
+	while (counters[n] != NULL) {
+	    n++;
+	}
+	data = (n != 0) ? malloc(2 * n * sizeof(uint64_t)) : NULL;
+	if (data != NULL) {
+	    for (i = 0; i < n; i++) {
+		data[2 * i] = counters[i][0];
+		data[2 * i + 1] = counters[i][1];
+	    }
+	}
+    }
+    ATOMIC_DEC(&p->running);
+
+    if (data != NULL) {
+	d_path(path, hash, ".prof");
+	fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0640);
+	if (fd >= 0) {
+	    iov.iov_base = data;
+	    iov.iov_len = 2 * n * sizeof(uint64_t);
+	    written = writev_all(fd, &iov, 1);
+	    close(fd);
+	    if (!written) {
+		remove(path);
+	    }
+	}
+	free(data);
+    }
+}
+
+/*
+ * NAME:	Writer->upgrade()
+ * DESCRIPTION:	pass on a request to optimize a program, unless the
+ *		optimized shared object is already in the cache
  */
-static void *p_del(Program *p)
+static void w_upgrade(WriteRequest *req)
 {
-    void *handle;
+    uint8_t hash[17];
+    DiskEntry *d;
+    uint32_t state;
 
-    if (--(p->refCount) == 0) {
-	handle = p->handle;
-	*p_find(p->hash) = p->next;
-	free(p);
-	return handle;
-    }
+    i_reserve();
+    MUTEX_LOCK(&lock); {
+	d = d_use(req->hash, time(NULL));
+	state = (d != NULL) ? records[d->record].state : 0;
+    } MUTEX_UNLOCK(&lock);
 
-    return NULL;
+    if (state & DISK_OPTIMIZED) {
+	STAT(STAT_CACHE_HITS);
+	memcpy(hash, req->hash, 16);
+	hash[16] = 2;
+	w_reply(JIT_REC_COMPILED, hash, 17);
+    } else if (state & DISK_OPT_FAILED) {
+	STAT(STAT_SKIPPED);
+    } else if (state & DISK_BYTECODE) {
+	if (profile) {
+	    w_profile(req->hash);
+	}
+	w_request(req, false);
+    }
 }
 
 /*
- * NAME:	Object->find()
- * DESCRIPTION:	find object
+ * NAME:	Writer->thread()
+ * DESCRIPTION:	write queued programs to the cache, and send the batched
+ *		requests and replies when the queue runs empty
  */
-static Object **o_find(uint64_t index, uint64_t instance)
+static void *w_thread(void *arg)
 {
-    Object **r;
-
-    for (r = &objects[index % NOBJECTS]; *r != NULL; r = &(*r)->next) {
-	if ((*r)->index == index && (*r)->instance == instance) {
+    Frame replies;
+    WriteRequest req;
+    Program *p;
+    DiskEntry *d;
+    bool retry;
+
+    d_trim();
+
+    MUTEX_LOCK(&wlock);
+    for (;;) {
+	while (wcount == 0 && !wstop) {
+	    if (wrequests.header.nRecords != 0) {
+		MUTEX_UNLOCK(&wlock);
+		f_flush(&wrequests, &w_send);
+		MUTEX_LOCK(&wlock);
+		continue;
+	    }
+	    if (wreplies.header.nRecords != 0) {
+		/* no pipe I/O while holding the lock */
+		f_take(&replies, &wreplies);
+		MUTEX_UNLOCK(&wlock);
+		f_flush(&replies, &lpc_ext_writeback);
+		MUTEX_LOCK(&wlock);
+		continue;
+	    }
+	    COND_WAIT(&wcond, &wlock);
+	}
+	if (wstop) {
 	    break;
 	}
+	req = wqueue[wfirst];
+	wfirst = (wfirst + 1) % WRITE_QUEUE;
+	--wcount;
+	MUTEX_UNLOCK(&wlock);
+
+	if (req.tier > 1) {
+	    w_upgrade(&req);
+	    free(req.data);
+	} else if (req.data != NULL) {
+	    w_write(&req);
+	    free(req.data);
+	} else {
+	    /*
+	     * pass on the current hotness, and allow the next hint; retry
+	     * a program that is no longer being compiled after a transient
+	     * failure
+	     */
+	    MUTEX_LOCK(&lock); {
+		p = p_find(req.hash);
+		if (p != NULL) {
+		    req.hotness = p->calls;
+		    ATOMIC_STORE(&p->hinted, 0);
+		}
+		d = d_find(req.hash);
+		retry = (d != NULL && !d->pending &&
+			 (records[d->record].state &
+			  (DISK_BYTECODE | DISK_BUILT | DISK_FAILED)) ==
+							    DISK_BYTECODE);
+		if (retry) {
+		    d->pending = true;
+		    d->requested = st_now();
+		}
+	    } MUTEX_UNLOCK(&lock);
+	    w_request(&req, !retry);
+	}
+
+	MUTEX_LOCK(&wlock);
     }
+    MUTEX_UNLOCK(&wlock);
 
-    return r;
+    return NULL;
 }
 
 /*
- * NAME:	Object->new()
- * DESCRIPTION:	create a new cache entry
+ * NAME:	Program->called()
+ * DESCRIPTION:	count a call to a program waiting to be compiled
  */
-static Object *o_new(Object **r, uint64_t index, uint64_t instance)
+static void p_called(Program *p)
 {
-    Object *o;
-
-    o = *r = malloc(sizeof(Object));
-    o->index = index;
-    o->instance = instance;
-    o->program = NULL;
-    o->next = NULL;
+    uint32_t calls;
 
-    return o;
+    /* hint at powers of two, to keep the number of hints down */
+    calls = ATOMIC_INC(&p->calls);
+    if ((calls & (calls - 1)) == 0 && calls >= 16 &&
+	ATOMIC_CAS(&p->hinted, 0, 1) && !w_hint(p->hash, calls)) {
+	ATOMIC_STORE(&p->hinted, 0);
+    }
 }
 
 /*
- * NAME:	Object->del()
- * DESCRIPTION:	remove a cache entry
+ * NAME:	Program->executed()
+ * DESCRIPTION:	count a sample of the calls to a compiled program, and have
+ *		it optimized once it has become hot
  */
-static void *o_del(Object **r)
+static void p_executed(Program *p)
 {
-    Object *o;
-    void *handle;
+    uint64_t calls;
 
-    o = *r;
-    handle = (o->program != NULL) ? p_del(o->program) : NULL;
-    *r = o->next;
-    free(o);
-
-    return handle;
+    if (p->tier == 1 && !p->hot && (++hotCount & HOT_SAMPLE) == 0) {
+	calls = (uint64_t) ATOMIC_INC(&p->execs) * (HOT_SAMPLE + 1);
+	if (calls >= hotThreshold && ATOMIC_CAS(&p->hot, 0, 1) &&
+	    !w_optimize(p->hash, (uint32_t) calls)) {
+	    ATOMIC_STORE(&p->hot, 0);	/* try again later */
+	}
+    }
 }
 
+/*
+ * NAME:	JIT->compiled()
+ * DESCRIPTION:	load a compiled program, replacing a lower tier
+ */
+static void jit_compiled(uint8_t *hash, int tier)
+{
+    char fname[33];
+    char module[2 * CONFIG_SIZE];
+    Program *p;
+    LPC_function *functions;
+    DiskEntry *d;
+    Handle handle;
+    bool fresh;
+    uint32_t state;
+    uint64_t size, start;
 
-# define CONFIG_SIZE	1000
-
-static char configDir[CONFIG_SIZE];
-static int flags;
-static void **vm;
-static uint8_t intInheritSize;
-static bool active;
-
-# ifndef WIN32
-# define THREAD_START(func)	pthread_create(&tid, NULL, func, NULL)
-# define THREAD_STOP()		pthread_join(tid, NULL)
-# define MUTEX_INIT(lock)	pthread_mutex_init(lock, NULL)
-# define MUTEX_DESTROY(lock)	pthread_mutex_destroy(lock)
-# define MUTEX_LOCK(lock)	pthread_mutex_lock(lock)
-# define MUTEX_UNLOCK(lock)	pthread_mutex_unlock(lock)
-# define DLL_OPEN(mod)		dlopen(mod, RTLD_NOW | RTLD_LOCAL)
-# define DLL_CLOSE(handle)	dlclose(handle)
-# define DLL_SYM(handle, sym)	dlsym(handle, sym)
-# define O_BINARY		0
-# define DLL_EXT		".so"
+    filename(fname, hash);
+    sprintf(module, "%s/cache/%c%c/%s%s", configDir, fname[0], fname[1],
+	    fname, (tier > 1) ? ".2" DLL_EXT : DLL_EXT);
+    state = (tier > 1) ? DISK_OPTIMIZED : DISK_BUILT;
 
-typedef void* Handle;
+    /* only files of a tier just compiled are not yet in the cache size */
+    MUTEX_LOCK(&lock); {
+	d = d_find(hash);
+	fresh = (d == NULL || !(records[d->record].state & state));
+    } MUTEX_UNLOCK(&lock);
+    size = (fresh) ? d_files(hash, built[(tier > 1)]) : 0;
+
+    p = NULL;
+    start = st_now();
+    handle = DLL_OPEN(module);
+    functions = (handle != NULL) ?
+		 (LPC_function *) DLL_SYM(handle, "functions") : NULL;
+    st_time(HIST_LOAD, start);
+    STAT((functions != NULL) ? STAT_LOADED : STAT_LOAD_FAILED);
+    MUTEX_LOCK(&lock); {
+	d = d_use(hash, time(NULL));
+	if (d != NULL) {
+	    if (tier == 1) {
+		if (d->requested != 0) {
+		    st_time(HIST_COMPILE, d->requested);
+		    STAT(STAT_COMPILED);
+		    d->requested = 0;
+		}
+		d->pending = false;
+	    }
 
-static pthread_mutex_t lock;
-static pthread_t tid;
-# else
-# define THREAD_START(func)	_beginthread((void (*)(void*)) func, 0, NULL)
-# define THREAD_STOP()		/* */
-# define MUTEX_INIT(lock)	InitializeCriticalSection(lock)
-# define MUTEX_DESTROY(lock)	DeleteCriticalSection(lock)
-# define MUTEX_LOCK(lock)	EnterCriticalSection(lock)
-# define MUTEX_UNLOCK(lock)	LeaveCriticalSection(lock)
-# define DLL_OPEN(mod)		LoadLibrary((LPCSTR) mod)
-# define DLL_CLOSE(handle)	FreeLibrary(handle)
-# define DLL_SYM(handle, sym)	GetProcAddress(handle, (LPCSTR) sym)
-# define alloca			_alloca
-# define access			_access
-# define mkdir(path, mode)	_mkdir(path)
-# define open			_open
-# define write			_write
-# define close			_close
-# define DLL_EXT		".dll"
+	    if (!(records[d->record].state & state)) {
+		d_size(d, records[d->record].size + size);
+	    }
 
-typedef HMODULE Handle;
+	    /* a shared object that cannot be loaded will be rebuilt */
+	    if (functions != NULL) {
+		records[d->record].state |= state;
+	    } else {
+		records[d->record].state &= ~state;
+	    }
+	}
+	if (functions != NULL) {
+	    p = p_find(hash);
+	    if (p != NULL && p->tier < tier) {
+		if (p->functions != NULL) {
+		    /*
+		     * hot-swap, keeping the baseline tier loaded for as long
+		     * as the program exists
+		     */
+		    p->base = p->handle;
+		    STAT(STAT_OPTIMIZED);
+		}
+		p->handle = handle;
+		p->tier = tier;
+		ATOMIC_STORE(&p->functions, functions);
+	    } else {
+		p = NULL;	/* not needed, or preloaded */
+	    }
+	}
+    } MUTEX_UNLOCK(&lock);
 
-static CRITICAL_SECTION lock;
-# endif
+    if (p == NULL && handle != NULL) {
+	DLL_CLOSE(handle);
+    }
+}
 
 /*
- * NAME:	filename()
- * DESCRIPTION:	hash to filename
+ * NAME:	JIT->failed()
+ * DESCRIPTION:	remember that a program failed to compile, unless the
+ *		failure was transient
  */
-static void filename(char *buffer, uint8_t *hash)
+static void jit_failed(uint8_t *hash, int tier, bool transient)
 {
-    static const char hex[] = "0123456789abcdef";
-    int i;
+    DiskEntry *d;
+    Program *p;
+    uint64_t size;
 
-    for (i = 0; i < 16; i++) {
-	*buffer++ = hex[hash[i] >> 4];
-	*buffer++ = hex[hash[i] & 0xf];
-    }
-    *buffer = '\0';
+    STAT((transient) ? STAT_TRANSIENT : STAT_FAILED);
+    size = (transient) ? 0 : d_files(hash, errors[(tier > 1)]);
+    MUTEX_LOCK(&lock); {
+	d = d_use(hash, time(NULL));
+	if (d != NULL) {
+	    if (tier > 1) {
+		records[d->record].state &= ~DISK_OPTIMIZED;
+		if (!transient) {
+		    /* don't try again */
+		    records[d->record].state |= DISK_OPT_FAILED;
+		}
+	    } else {
+		if (d->requested != 0) {
+		    st_time(HIST_COMPILE, d->requested);
+		    d->requested = 0;
+		}
+		d->pending = false;
+		records[d->record].state &= ~DISK_BUILT;
+		if (!transient) {
+		    /* don't try again */
+		    records[d->record].state |= DISK_FAILED;
+		}
+	    }
+	    d_size(d, records[d->record].size + size);
+	}
+	if (transient && tier > 1) {
+	    /* request optimization again after as many calls */
+	    p = p_find(hash);
+	    if (p != NULL) {
+		p->execs = 0;
+		ATOMIC_STORE(&p->hot, 0);
+	    }
+	}
+    } MUTEX_UNLOCK(&lock);
 }
 
 /*
- * NAME:	md5hash()
- * DESCRIPTION:	compute MD5 hash
+ * NAME:	JIT->released()
+ * DESCRIPTION:	remove a released object
  */
-static void md5hash(uint8_t *hash, unsigned char *buffer, size_t size)
+static void jit_released(uint64_t index, uint64_t instance)
 {
-    uint32_t digest[4];
-    unsigned char tmp[64];
-    size_t sz;
+    Object *o;
 
-    /*
-     * compute MD5 hash
-     */
-    (*lpc_md5_start)(digest);
-    for (sz = size; sz >= 64; buffer += 64, sz -= 64) {
-	(*lpc_md5_block)(digest, buffer);
-    }
-    memcpy(tmp, buffer, sz);
-    (*lpc_md5_end)(hash, digest, tmp, (uint16_t) sz, size);
+    MUTEX_LOCK(&lock); {
+	o = o_find(index, instance);
+	if (o != NULL) {
+	    o_del(o);
+	}
+    } MUTEX_UNLOCK(&lock);
 }
 
 /*
  * NAME:	JIT->thread()
- * DESCRIPTION:	receive objects compiled or removed
+ * DESCRIPTION:	receive objects compiled, failed or removed
  */
 static void *jit_thread(void *arg)
 {
-    uint8_t hash[24];
-    Handle handle;
-
-    while (lpc_ext_read(hash + 7, 17) == 17) {
-	if (hash[7] == '\0') {
-	    char fname[33];
-	    char module[2 * CONFIG_SIZE];
-	    Program *p;
-	    LPC_function *functions;
-
-	    /* compiled */
-	    filename(fname, hash + 8);
-	    sprintf(module, "%s/cache/%c%c/%s" DLL_EXT, configDir, fname[0],
-		    fname[1], fname);
-	    p = NULL;
-	    handle = DLL_OPEN(module);
-	    if (handle != NULL) {
-		functions = (LPC_function *) DLL_SYM(handle, "functions");
-		if (functions != NULL) {
-		    MUTEX_LOCK(&lock); {
-			p = *p_find(hash + 8);
-			if (p != NULL) {
-			    p->handle = handle;
-			    p->functions = functions;
-			} else {
-			    p = NULL;
-			}
-		    } MUTEX_UNLOCK(&lock);
-		}
+    Frame f;
+    JitRecord rec;
+    uint8_t *p, *end;
+    uint64_t data[2];
+    int tier;
+    bool transient;
+
+    while (f_read(&f)) {
+	if (f.header.version != JIT_PROTOCOL) {
+	    continue;
+	}
+	end = (uint8_t *) &f + f.header.size;
+	for (p = f.data; p + sizeof(JitRecord) <= end;
+	     p += sizeof(JitRecord) + rec.size) {
+	    memcpy(&rec, p, sizeof(JitRecord));
+	    if (p + sizeof(JitRecord) + rec.size > end) {
+		break;
 	    }
-
-	    if (p == NULL && handle != NULL) {
-		DLL_CLOSE(handle);
+	    if (rec.size < 16) {
+		continue;
+	    }
+	    memcpy(data, p + sizeof(JitRecord), 16);
+	    tier = (rec.size > 16) ? p[sizeof(JitRecord) + 16] : 1;
+	    transient = (rec.size > 17 && p[sizeof(JitRecord) + 17] != 0);
+
+	    switch (rec.type) {
+	    case JIT_REC_COMPILED:
+		jit_compiled((uint8_t *) data, tier);
+		break;
+
+	    case JIT_REC_FAILED:
+		jit_failed((uint8_t *) data, tier, transient);
+		break;
+
+	    case JIT_REC_RELEASED:
+		jit_released(data[0], data[1]);
+		break;
 	    }
-	} else {
-	    uint64_t index, instance;
-
-	    /* removed */
-	    index = *((uint64_t *) (hash + 8));
-	    instance = *((uint64_t *) (hash + 16));
-
-	    MUTEX_LOCK(&lock); {
-		Object **r;
-
-		r = o_find(index, instance);
-		if (*r != NULL) {
-		    handle = o_del(r);
-		    if (handle != NULL) {
-			DLL_CLOSE(handle);
-		    }
-		}
-	    } MUTEX_UNLOCK(&lock);
 	}
+
+	/*
+	 * free what readers can no longer see
+	 */
+	MUTEX_LOCK(&lock); {
+	    e_reclaim();
+	} MUTEX_UNLOCK(&lock);
+	e_close();
     }
 
     active = false;
@@ -327,6 +3073,12 @@ static int jit_init(int major, int minor, size_t intSize, size_t inheritSize,
     info.nBuiltins = nBuiltins;
     info.nKfuns = nKfuns;
     info.protoSize = protoSize;
+    info.nWorkers = workers;
+    info.optLevel[0] = optLevel;
+    info.optLevel[1] = hotOptLevel;
+    if (profile && hotThreshold != 0) {
+	info.flags |= JIT_PROFILE;
+    }
 
     if (lpc_ext_write(&info, sizeof(JitInfo)) != sizeof(JitInfo) ||
 	lpc_ext_write(protos, protoSize) != protoSize ||
@@ -340,9 +3092,31 @@ static int jit_init(int major, int minor, size_t intSize, size_t inheritSize,
     /*
      * create loader thread
      */
+    h_init(&programs);
+    h_init(&objects);
+    h_init(&disk);
+    h_init(&preloads);
+    if (KEY_CREATE(&slotKey, &e_release) != 0) {
+	fprintf(stderr, "JIT: cannot create thread key\n");
+	return false;
+    }
     MUTEX_INIT(&lock);
+    if (!d_load()) {
+	fprintf(stderr, "JIT: cannot open cache index\n");
+	MUTEX_DESTROY(&lock);
+	KEY_DELETE(slotKey);
+	return false;
+    }
+    MUTEX_INIT(&wlock);
+    COND_INIT(&wcond);
+    f_init(&wrequests);
+    f_init(&wreplies);
+    pl_list();
     active = true;
-    THREAD_START(&jit_thread);
+    THREAD_START(tid, &jit_thread);
+    THREAD_START(wtid, &w_thread);
+    THREAD_START(ptid, &pl_thread);
+    initialized = true;
 
     return true;
 }
@@ -353,8 +3127,66 @@ static int jit_init(int major, int minor, size_t intSize, size_t inheritSize,
  */
 static void jit_finish(void)
 {
-    THREAD_STOP();
+    Program *p;
+
+    initialized = false;
+
+    /*
+     * stop preloading, and remember what is loaded now
+     */
+    pstop = true;
+    THREAD_STOP(ptid);
+    pl_save();
+    h_each(&preloads, &pl_close, NULL);
+    free(preloadList);
+
+    /*
+     * stop writer thread, discarding requests not yet written, and send the
+     * remaining replies
+     */
+    MUTEX_LOCK(&wlock);
+    wstop = true;
+    COND_SIGNAL(&wcond);
+    MUTEX_UNLOCK(&wlock);
+# ifdef __linux__
+    if (ring != NULL) {
+	r_stop();
+    }
+# endif
+    THREAD_STOP(wtid);
+    while (wcount != 0) {
+	free(wqueue[wfirst].data);
+	wfirst = (wfirst + 1) % WRITE_QUEUE;
+	--wcount;
+    }
+    f_flush(&wreplies, &lpc_ext_writeback);
+
+    THREAD_STOP(tid);
+    e_close();
+    while (nUnloads != 0) {
+	--nUnloads;
+	if (unloads[nUnloads].slab == NULL) {
+	    DLL_CLOSE((Handle) unloads[nUnloads].item);
+	} else {
+	    p = (Program *) unloads[nUnloads].item;
+	    if (p->handle != NULL) {
+		DLL_CLOSE((Handle) p->handle);
+	    }
+	    if (p->base != NULL) {
+		DLL_CLOSE((Handle) p->base);
+	    }
+	}
+    }
+    d_close();
+# ifdef __linux__
+    if (ring != NULL) {
+	r_close();
+    }
+# endif
+    COND_DESTROY(&wcond);
+    MUTEX_DESTROY(&wlock);
     MUTEX_DESTROY(&lock);
+    KEY_DELETE(slotKey);
 }
 
 
@@ -367,72 +3199,82 @@ static void jit_compile(uint64_t index, uint64_t instance, int nInherits,
 			uint8_t *funcTypes, size_t fTypeSize, uint8_t *varTypes,
 			size_t vTypeSize)
 {
-    size_t size;
-    JitCompile *comp;
-    unsigned char buffer[131072], *p;
+    JitCompile comp;
+    struct iovec iov[4];
     uint8_t hash[24];
-    Object *c;
-    char file[33], path[2 * CONFIG_SIZE];
-    int fd;
+    Object *o;
+    Program *program;
+    Preload *pl;
+    LPC_function *functions;
+    uint32_t hotness;
+    uint64_t start;
 
     if (active) {
+	start = st_now();
+
 	/*
-	 * fill buffer with data for compiler backend
+	 * collect data for compiler backend
 	 */
-	size = sizeof(JitCompile) + progSize + fTypeSize + vTypeSize;
-	p = buffer;
-	comp = (JitCompile *) p;
-	memset(comp, '\0', sizeof(JitCompile));
-	comp->flags = flags;
-	comp->intInheritSize = intInheritSize;
-	comp->nInherits = nInherits;
-	comp->nFunctions = nFunctions;
-	comp->progSize = progSize;
-	comp->fTypeSize = fTypeSize;
-	comp->vTypeSize = vTypeSize;
-	p += sizeof(JitCompile);
-	memcpy(p, prog, progSize);
-	p += progSize;
-	memcpy(p, funcTypes, fTypeSize);
-	p += fTypeSize;
-	memcpy(p, varTypes, vTypeSize);
+	memset(&comp, '\0', sizeof(JitCompile));
+	comp.flags = flags;
+	comp.intInheritSize = intInheritSize;
+	comp.nInherits = nInherits;
+	comp.nFunctions = nFunctions;
+	comp.progSize = progSize;
+	comp.fTypeSize = fTypeSize;
+	comp.vTypeSize = vTypeSize;
+	iov[0].iov_base = &comp;
+	iov[0].iov_len = sizeof(JitCompile);
+	iov[1].iov_base = prog;
+	iov[1].iov_len = progSize;
+	iov[2].iov_base = funcTypes;
+	iov[2].iov_len = fTypeSize;
+	iov[3].iov_base = varTypes;
+	iov[3].iov_len = vTypeSize;
 
 	/*
 	 * compute MD5 hash
 	 */
-	md5hash(hash + 8, buffer, size);
+	md5hash(hash + 8, iov, 4);
 	MUTEX_LOCK(&lock); {
-	    c = *o_find(index, instance);
-	    c->program = p_new(hash + 8);
-	} MUTEX_UNLOCK(&lock);
-
-	if (c->program->functions == NULL) {
-	    filename(file, hash + 8);
-	    sprintf(path, "%s/cache/%c%c", configDir, file[0], file[1]);
-	    mkdir(path, 0750);
-	    sprintf(path + strlen(path), "/%s", file);
-	    if (access(path, 0) == 0) {
-		/*
-		 * reuse existing data
-		 */
-		hash[7] = '\0';
-		lpc_ext_writeback(hash + 7, 17);
-	    } else {
-		/*
-		 * write to file
-		 */
-		fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_BINARY, 0640);
-		if (fd >= 0) {
-		    if (write(fd, buffer, size) == size) {
-			/*
-			 * inform backend
-			 */
-			lpc_ext_write(hash + 8, 16);
+	    o = o_find(index, instance);
+	    hotness = o->calls;
+	    pl = (unclaimed != 0) ? pl_find(hash + 8) : NULL;
+	    if (hotness >= threshold || pl != NULL) {
+		program = p_new(hash + 8, index, instance);
+		if (program != NULL) {
+		    if (pl != NULL) {
+			pl_claim(program, pl);
 		    }
-		    close(fd);
+		    ATOMIC_STORE(&o->program, program);
+		    functions = program->functions;
+		} else {
+		    /* out of memory: let the object request compilation again */
+		    o->calls = 0;
 		}
+	    } else {
+		/* submitted early to match preloaded programs */
+		pl_miss();
+		program = NULL;
 	    }
+	} MUTEX_UNLOCK(&lock);
+
+	if (program != NULL && functions == NULL &&
+	    !w_add(hash + 8, hotness, iov, 4)) {
+	    /*
+	     * dropped: let the object request compilation again
+	     */
+	    MUTEX_LOCK(&lock); {
+		o = o_find(index, instance);
+		if (o != NULL && o->program == program &&
+		    program->functions == NULL) {
+		    ATOMIC_STORE(&o->program, NULL);
+		    o->calls = 0;
+		    p_del(program);
+		}
+	    } MUTEX_UNLOCK(&lock);
 	}
+	st_time(HIST_SUBMIT, start);
     }
 }
 
@@ -443,26 +3285,56 @@ static void jit_compile(uint64_t index, uint64_t instance, int nInherits,
 static int jit_execute(uint64_t index, uint64_t instance, int version, int func,
 		       void *arg)
 {
-    Object **r, *o;
-
-    MUTEX_LOCK(&lock); {
-	r = o_find(index, instance);
-	o = *r;
-	if (o == NULL) {
-	    o_new(r, index, instance);
-	}
-    } MUTEX_UNLOCK(&lock);
+    bool entered, hot;
+    Object *o;
+    Program *p;
+    LPC_function *functions;
+    uint32_t calls;
+    uint64_t start;
+
+    entered = e_enter();
+    o = o_get(index, instance, entered);
+    if (o == NULL) {
+	e_exit(entered);
+	STAT(STAT_EXEC_NONE);
+	return 0;
+    }
+    p = ATOMIC_LOAD(&o->program);
+    if (p == NULL) {
+	/* request compilation once the object has become hot */
+	calls = ATOMIC_INC(&o->calls);
+	hot = (calls == threshold ||
+	       (calls == 1 && preloading && pl_object(index, instance)));
+	e_exit(entered);
+	STAT((hot) ? STAT_EXEC_REQUEST : STAT_EXEC_NONE);
+	return (hot) ? -1 : 0;
+    }
+    functions = ATOMIC_LOAD(&p->functions);
+    if (functions == NULL) {
+	p_called(p);
+	e_exit(entered);
+	STAT(STAT_EXEC_NONE);
+	return 0;
+    }
+    if (hotThreshold != 0) {
+	p_executed(p);
+    }
+    STAT(STAT_EXEC_JIT);
 
-    if (o != NULL) {
-	if (o->program != NULL && o->program->functions != NULL) {
-	    (o->program->functions[func])(vm, arg);
-	    return 1;
-	} else {
-	    return 0;
-	}
+    /*
+     * keep the shared object loaded while calling it
+     */
+    ATOMIC_INC(&p->running);
+    e_exit(entered);
+    if ((++execCount & EXEC_SAMPLE) == 0) {
+	start = st_now();
+	(functions[func])(vm, arg);
+	st_time(HIST_EXECUTE, start);
     } else {
-	return -1;
+	(functions[func])(vm, arg);
     }
+    ATOMIC_DEC(&p->running);
+    return 1;
 }
 
 /*
@@ -472,26 +3344,37 @@ static int jit_execute(uint64_t index, uint64_t instance, int version, int func,
 static int jit_functions(uint64_t index, uint64_t instance, int version,
 			 LPC_function **functions)
 {
-    Object **r, *o;
-
-    MUTEX_LOCK(&lock); {
-	r = o_find(index, instance);
-	o = *r;
-	if (o == NULL) {
-	    o_new(r, index, instance);
-	}
-    } MUTEX_UNLOCK(&lock);
-
-    if (o != NULL) {
-	if (o->program != NULL && o->program->functions != NULL) {
-	    *functions = o->program->functions;
-	    return 1;
-	} else {
-	    return 0;
-	}
-    } else {
-	return -1;
+    bool entered, hot;
+    Object *o;
+    Program *p;
+    uint32_t calls;
+
+    entered = e_enter();
+    o = o_get(index, instance, entered);
+    if (o == NULL) {
+	e_exit(entered);
+	*functions = NULL;
+	return 0;
+    }
+    p = ATOMIC_LOAD(&o->program);
+    if (p == NULL) {
+	/* request compilation once the object has become hot */
+	calls = ATOMIC_INC(&o->calls);
+	hot = (calls == threshold ||
+	       (calls == 1 && preloading && pl_object(index, instance)));
+	e_exit(entered);
+	*functions = NULL;
+	return (hot) ? -1 : 0;
     }
+    *functions = ATOMIC_LOAD(&p->functions);
+    if (*functions == NULL) {
+	p_called(p);
+    } else if (hotThreshold != 0) {
+	p_executed(p);
+    }
+    e_exit(entered);
+
+    return (*functions != NULL);
 }
 
 /*
@@ -500,14 +3383,95 @@ static int jit_functions(uint64_t index, uint64_t instance, int version,
  */
 static void jit_release(uint64_t index, uint64_t instance)
 {
-    uint8_t buf[24];
+    uint64_t data[2];
+
+    data[0] = index;
+    data[1] = instance;
+    w_reply(JIT_REC_RELEASED, data, 16);
+}
+
+/*
+ * NAME:	Stats->put()
+ * DESCRIPTION:	add a value to the statistics mapping
+ */
+static void st_put(LPC_dataspace data, LPC_mapping map, const char *name,
+		   LPC_value val)
+{
+    LPC_value key;
+
+    key = lpc_value_temp(data);
+    lpc_string_putval(key, lpc_string_new(data, name, strlen(name)));
+    lpc_mapping_assign(data, map, key, val);
+}
+
+/*
+ * NAME:	Stats->int()
+ * DESCRIPTION:	add an integer to the statistics mapping
+ */
+static void st_int(LPC_dataspace data, LPC_mapping map, const char *name,
+		   uint64_t n)
+{
+    LPC_value val;
+
+    val = lpc_value_temp2(data);
+    lpc_int_putval(val, (LPC_int) n);
+    st_put(data, map, name, val);
+}
+
+/*
+ * NAME:	kfun jit_statistics()
+ * DESCRIPTION:	return JIT statistics in a mapping
+ */
+static void jit_statistics(LPC_frame f, int nargs, LPC_value retval)
+{
+    LPC_dataspace data;
+    LPC_mapping map;
+    LPC_array arr;
+    LPC_value val;
+    int i, j;
+
+    /* tick cost */
+    lpc_runtime_check(f, STATS + HISTS * HIST_BUCKETS);
+
+    data = lpc_frame_dataspace(f);
+    map = lpc_mapping_new(data);
+    for (i = 0; i < STATS; i++) {
+	st_int(data, map, statNames[i], ATOMIC_LOAD(&stats[i]));
+    }
+    for (i = 0; i < HISTS; i++) {
+	arr = lpc_array_new(data, HIST_BUCKETS);
+	val = lpc_value_temp2(data);
+	for (j = 0; j < HIST_BUCKETS; j++) {
+	    lpc_int_putval(val, (LPC_int) ATOMIC_LOAD(&hists[i][j]));
+	    lpc_array_assign(data, arr, j, val);
+	}
+	lpc_array_putval(val, arr);
+	st_put(data, map, histNames[i], val);
+    }
+
+    /* current state, if the JIT compiler was initialized */
+    if (initialized) {
+	MUTEX_LOCK(&lock); {
+	    st_int(data, map, "programs", programs.count);
+	    st_int(data, map, "objects", objects.count);
+	    st_int(data, map, "preloads", unclaimed);
+	    st_int(data, map, "cache_size", diskSize);
+	} MUTEX_UNLOCK(&lock);
+	MUTEX_LOCK(&wlock); {
+	    st_int(data, map, "queued", wcount);
+	} MUTEX_UNLOCK(&wlock);
+    }
 
-    buf[7] = '\1';
-    *((uint64_t *) (buf + 8)) = index;
-    *((uint64_t *) (buf + 16)) = instance;
-    lpc_ext_writeback(buf + 7, 17);
+    lpc_mapping_putval(retval, map);
 }
 
+static char jit_statistics_proto[] = { LPC_TYPE_MAPPING, 0 };
+static LPC_ext_kfun kf[1] = {
+    "jit_statistics",
+    jit_statistics_proto,
+    &jit_statistics
+};
+
 /*
  * NAME:	LPC->ext_init()
  * DESCRIPTION:	initialize JIT compiler frontend
@@ -515,18 +3479,33 @@ static void jit_release(uint64_t index, uint64_t instance)
 int lpc_ext_init(int major, int minor, const char *config)
 {
     char jitcomp[3 * CONFIG_SIZE];
+    bool success;
 
     if (strlen(config) >= CONFIG_SIZE) {
 	return 0;
     }
 
     strcpy(configDir, config);
+    c_read(config);
 # ifndef WIN32
     sprintf(jitcomp, "exec %s/jitcomp %s", config, config);
+# ifdef __linux__
+    if (ringSize != 0 && r_create(ringSize)) {
+	/* jitcomp inherits the ring */
+	sprintf(jitcomp + strlen(jitcomp), " %d %d %d", ringFd, dataFd, roomFd);
+    }
+# endif
 # else
     sprintf(jitcomp, "%s/jitcomp.exe %s", config, config);
 # endif
-    if (lpc_ext_spawn(jitcomp)) {
+    success = lpc_ext_spawn(jitcomp);
+# ifdef __linux__
+    if (ring != NULL) {
+	r_spawned(success);
+    }
+# endif
+    if (success) {
+	lpc_ext_kfun(kf, 1);
 	(*lpc_ext_jit)(&jit_init, &jit_finish, &jit_compile, &jit_execute,
 		       &jit_release, &jit_functions);
 	return 1;
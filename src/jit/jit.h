@@ -1,3 +1,5 @@
+# define JIT_TIERS		2	/* baseline and optimized */
+
 typedef struct {
     uint8_t major;		/* 2 */
     uint8_t minor;		/* 4 */
@@ -7,6 +9,8 @@ typedef struct {
     int nBuiltins;		/* # builtin prototypes */
     int nKfuns;			/* # kfun prototypes */
     size_t protoSize;		/* size of all prototypes together */
+    int nWorkers;		/* # compile workers */
+    int optLevel[JIT_TIERS];	/* optimization level per tier */
 } JitInfo;
 
 typedef struct {
@@ -19,6 +23,73 @@ typedef struct {
     size_t vTypeSize;		/* variable type size */
 } JitCompile;
 
+/*
+ * After initialization, messages are exchanged in frames of at most
+ * JIT_FRAME_MAX bytes, small enough for a write to a pipe to be atomic when
+ * the pipe has several writers.  A frame holds a series of records, each
+ * consisting of a JitRecord header followed by its data.  Readers skip
+ * records of unknown types, and data beyond the fields they know about.
+ */
+typedef struct {
+    uint16_t size;		/* size of frame, including header */
+    uint8_t version;		/* JIT_PROTOCOL */
+    uint8_t nRecords;		/* # records in frame */
+} JitFrame;
+
+typedef struct {
+    uint8_t type;		/* record type */
+    uint8_t size;		/* size of data following */
+} JitRecord;
+
+# define JIT_PROTOCOL		1	/* frame version */
+# define JIT_FRAME_MAX		512	/* POSIX minimum for PIPE_BUF */
+
+/*
+ * records, with an optional tier byte that defaults to 1; a failure may be
+ * followed by a byte that is nonzero if compiling the program again could
+ * succeed
+ */
+# define JIT_REC_COMPILE	1	/* hash, hotness, tier: compile program */
+# define JIT_REC_HINT		2	/* hash, hotness, tier: program got hotter */
+# define JIT_REC_COMPILED	3	/* hash, tier: program compiled */
+# define JIT_REC_FAILED		4	/* hash, tier, transient: compile failed */
+# define JIT_REC_RELEASED	5	/* index, instance: object released */
+
+/*
+ * On Linux, frames for jitcomp can be passed through a ring buffer in shared
+ * memory instead, along with the programs to compile.  The ring data follows
+ * the JitRing header at offset JIT_RING_DATA.  Entries consist of a JitEntry
+ * followed by its data, padded to a multiple of 8 bytes; an entry does not
+ * wrap around, the end of the ring is skipped instead.  Each side sleeps on
+ * an eventfd after setting its flag in the header.
+ */
+typedef struct {
+    volatile uint64_t head;	/* producer offset */
+    uint8_t pad1[56];		/* keep head and tail in separate cache lines */
+    volatile uint64_t tail;	/* consumer offset */
+    uint8_t pad2[56];
+    volatile uint32_t sleeping;	/* consumer waits for data */
+    volatile uint32_t full;	/* producer waits for room */
+    uint64_t size;		/* size of ring data, a power of two */
+} JitRing;
+
+typedef struct {
+    uint32_t type;		/* entry type */
+    uint32_t size;		/* size of data following */
+} JitEntry;
+
+# define JIT_RING_DATA		4096	/* offset of ring data */
+# define JIT_RING_ALIGN(n)	(((n) + 7) & ~7)
+
+/* entries */
+# define JIT_ENTRY_SKIP		0	/* rest of ring unused */
+# define JIT_ENTRY_FRAME	1	/* JitFrame */
+# define JIT_ENTRY_PROGRAM	2	/* hash, JitCompile and program data */
+
 /* flags */
 # define JIT_TYPECHECKING      0x0f    /* typechecking mode */
 # define JIT_NOREF             0x10    /* no reference counting */
+# define JIT_PROFILE           0x20    /* count branches in baseline tier */
+
+/* compiler version, failed compilations are retried when it changes */
+# define JIT_VERSION            1
@@ -1,5 +1,12 @@
 # ifndef WIN32
 # include <unistd.h>
+# include <poll.h>
+# include <signal.h>
+# include <errno.h>
+# include <sys/wait.h>
+# ifdef __linux__
+# include <sys/mman.h>
+# endif
 # else
 # include <Windows.h>
 # include <io.h>
@@ -28,6 +35,9 @@ extern "C" {
 # endif
 # ifdef GENCLANG
 # include "genclang.h"
+# ifdef LLVM
+# include "llvmcomp.h"
+# endif
 # endif
 # include "jitcomp.h"
 
@@ -44,6 +54,8 @@ extern "C" {
 # define dup2			_dup2
 # endif
 
+static int optLevel[JIT_TIERS];	/* optimization level per tier */
+
 /*
  * fatal error
  */
@@ -64,8 +76,10 @@ void fatal(const char *format, ...)
  * JIT compile a single object using a particular code generator
  */
 static bool jitComp(CodeObject *object, CodeByte *prog, int nFunctions,
-		    char *base, int flags)
+		    char *base, int flags, int level, uint64_t *profile,
+		    int profileSize, bool *transient)
 {
+    *transient = false;
 # ifdef DISASM
     Code::producer(&DisCode::create);
     Block::producer(&DisBlock::create);
@@ -84,7 +98,7 @@ static bool jitComp(CodeObject *object, CodeByte *prog, int nFunctions,
     Block::producer(&ClangBlock::create);
 
     ClangObject clang(object, prog, nFunctions);
-    return clang.emit(base, flags);
+    return clang.emit(base, flags, level, profile, profileSize, transient);
 # endif
 }
 
@@ -105,21 +119,1039 @@ static void filename(char *buffer, uint8_t *hash)
     *buffer = '\0';
 }
 
+/*
+ * a request to compile a program, decoded from a frame record
+ */
+struct JitRequest {
+    uint8_t hash[16];		/* program hash */
+    uint32_t hotness;		/* # calls observed */
+    uint32_t hint;		/* only update hotness of queued program */
+    uint32_t tier;		/* optimization tier, starting at 1 */
+};
+
+/*
+ * pending compile requests, hottest first, indexed by hash and tier
+ */
+class CompileQueue {
+public:
+    CompileQueue() {
+	size = 64;
+	heap = new Entry[size];
+	nEntries = 0;
+	seq = 0;
+	mask = 2 * size - 1;
+	index = new int[mask + 1];
+	memset(index, 0xff, (mask + 1) * sizeof(int));
+	nUsed = 0;
+    }
+
+    virtual ~CompileQueue() {
+	delete[] index;
+	delete[] heap;
+    }
+
+    /*
+     * add a request, or raise the hotness of a program already queued for
+     * the same tier
+     */
+    void put(JitRequest *req) {
+	int i;
+
+	i = find(req);
+	if (i >= 0) {
+	    if (req->hotness > heap[i].req.hotness) {
+		heap[i].req.hotness = req->hotness;
+		up(i);
+	    }
+	    return;
+	}
+	if (req->hint) {
+	    return;	/* not queued */
+	}
+
+	if (nEntries == size) {
+	    Entry *entries;
+
+	    entries = new Entry[size << 1];
+	    memcpy(entries, heap, size * sizeof(Entry));
+	    delete[] heap;
+	    heap = entries;
+	    size <<= 1;
+	}
+	if (2 * (nUsed + 1) > mask + 1) {
+	    rehash();
+	}
+	heap[nEntries].req = *req;
+	heap[nEntries].seq = seq++;
+	heap[nEntries].slot = insert(req, nEntries);
+	up(nEntries++);
+    }
+
+    /*
+     * remove the hottest request
+     */
+    void get(JitRequest *req) {
+	*req = heap[0].req;
+	index[heap[0].slot] = DELETED;
+	heap[0] = heap[--nEntries];
+	if (nEntries != 0) {
+	    index[heap[0].slot] = 0;
+	    down(0);
+	}
+    }
+
+    bool empty() {
+	return (nEntries == 0);
+    }
+
+private:
+    struct Entry {
+	JitRequest req;		/* request */
+	uint32_t seq;		/* order of arrival */
+	int slot;		/* slot in index */
+    };
+
+    static const int EMPTY = -1;	/* unused index slot */
+    static const int DELETED = -2;	/* removed from index */
+
+    /*
+     * hash a request
+     */
+    static uint32_t hash(JitRequest *req) {
+	uint32_t h;
+
+	memcpy(&h, req->hash, sizeof(uint32_t));
+	return h ^ (req->tier * 0x9e3779b9);
+    }
+
+    /*
+     * find the heap position of a request for the same program and tier,
+     * or return -1
+     */
+    int find(JitRequest *req) {
+	int i, e;
+
+	for (i = hash(req) & mask; (e = index[i]) != EMPTY;
+	     i = (i + 1) & mask) {
+	    if (e >= 0 && memcmp(heap[e].req.hash, req->hash, 16) == 0 &&
+		heap[e].req.tier == req->tier) {
+		return e;
+	    }
+	}
+	return -1;
+    }
+
+    /*
+     * add a heap position to the index, and return its slot
+     */
+    int insert(JitRequest *req, int e) {
+	int i;
+
+	for (i = hash(req) & mask; index[i] >= 0; i = (i + 1) & mask) ;
+	if (index[i] == EMPTY) {
+	    nUsed++;
+	}
+	index[i] = e;
+	return i;
+    }
+
+    /*
+     * rebuild the index without deleted slots, larger if needed
+     */
+    void rehash() {
+	int i;
+
+	if (4 * (nEntries + 1) > mask + 1) {
+	    mask = 2 * mask + 1;
+	}
+	delete[] index;
+	index = new int[mask + 1];
+	memset(index, 0xff, (mask + 1) * sizeof(int));
+	nUsed = 0;
+	for (i = 0; i < nEntries; i++) {
+	    heap[i].slot = insert(&heap[i].req, i);
+	}
+    }
+
+    /*
+     * compare the priorities of two entries
+     */
+    bool before(Entry *a, Entry *b) {
+	return (a->req.hotness > b->req.hotness ||
+		(a->req.hotness == b->req.hotness && a->seq < b->seq));
+    }
+
+    /*
+     * move an entry to a heap position
+     */
+    void move(Entry *entry, int i) {
+	heap[i] = *entry;
+	index[entry->slot] = i;
+    }
+
+    void up(int i) {
+	Entry entry;
+	int parent;
+
+	entry = heap[i];
+	while (i != 0 && before(&entry, &heap[parent = (i - 1) >> 1])) {
+	    move(&heap[parent], i);
+	    i = parent;
+	}
+	move(&entry, i);
+    }
+
+    void down(int i) {
+	Entry entry;
+	int child;
+
+	entry = heap[i];
+	while ((child = (i << 1) + 1) < nEntries) {
+	    if (child + 1 < nEntries && before(&heap[child + 1], &heap[child])) {
+		child++;
+	    }
+	    if (!before(&heap[child], &entry)) {
+		break;
+	    }
+	    move(&heap[child], i);
+	    i = child;
+	}
+	move(&entry, i);
+    }
+
+    Entry *heap;		/* binary heap */
+    int size;			/* heap size */
+    int nEntries;		/* # entries in heap */
+    uint32_t seq;		/* arrival counter */
+    int *index;			/* heap positions by hash */
+    int mask;			/* # index slots - 1 */
+    int nUsed;			/* # index slots not empty */
+};
+
+/*
+ * programs received through shared memory, waiting to be compiled; the
+ * oldest are dropped when the list grows too large, and read from the cache
+ * instead when their turn comes
+ */
+# define PROGRAMS_MAX	(16 * 1024 * 1024)	/* max size of programs kept */
+
+class ProgramList {
+public:
+    ProgramList() {
+	list = NULL;
+	size = 0;
+    }
+
+    virtual ~ProgramList() {
+	while (list != NULL) {
+	    Program *prog;
+
+	    prog = list;
+	    list = prog->next;
+	    delete[] prog->data;
+	    delete prog;
+	}
+    }
+
+    /*
+     * add a copy of a program, replacing an older one with the same hash
+     */
+    void put(uint8_t *hash, uint8_t *data, size_t dataSize) {
+	Program **p, *prog;
+	size_t oldSize;
+
+	delete[] take(hash, &oldSize);
+	prog = new Program;
+	memcpy(prog->hash, hash, 16);
+	prog->data = new CodeByte[dataSize];
+	memcpy(prog->data, data, dataSize);
+	prog->size = dataSize;
+	prog->next = list;
+	list = prog;
+	size += dataSize;
+
+	while (size > PROGRAMS_MAX && list->next != NULL) {
+	    /* drop the oldest */
+	    for (p = &list; (*p)->next != NULL; p = &(*p)->next) ;
+	    prog = *p;
+	    *p = NULL;
+	    size -= prog->size;
+	    delete[] prog->data;
+	    delete prog;
+	}
+    }
+
+    /*
+     * remove a program from the list, and return its data
+     */
+    CodeByte *take(uint8_t *hash, size_t *dataSize) {
+	Program **p, *prog;
+	CodeByte *data;
+
+	for (p = &list; *p != NULL; p = &(*p)->next) {
+	    if (memcmp((*p)->hash, hash, 16) == 0) {
+		prog = *p;
+		*p = prog->next;
+		data = prog->data;
+		*dataSize = prog->size;
+		size -= prog->size;
+		delete prog;
+		return data;
+	    }
+	}
+	return NULL;
+    }
+
+private:
+    struct Program {
+	uint8_t hash[16];	/* program hash */
+	CodeByte *data;		/* JitCompile and program data */
+	size_t size;		/* size of data */
+	Program *next;		/* next in list */
+    };
+
+    Program *list;		/* programs, newest first */
+    size_t size;		/* total size of program data */
+};
+
+/*
+ * read exactly size bytes
+ */
+static bool readAll(int fd, void *buffer, int size)
+{
+    char *p;
+    int n;
+
+    for (p = (char *) buffer; size != 0; p += n, size -= n) {
+	n = read(fd, p, size);
+	if (n <= 0) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * write exactly size bytes
+ */
+static bool writeAll(int fd, const void *buffer, int size)
+{
+    const char *p;
+    int n;
+
+    for (p = (const char *) buffer; size != 0; p += n, size -= n) {
+	n = write(fd, p, size);
+	if (n <= 0) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * add the requests in a frame to the queue
+ */
+static void putRequests(CompileQueue *queue, uint8_t *data, size_t size)
+{
+    JitFrame frame;
+    JitRecord rec;
+    JitRequest req;
+    uint8_t *p, *end;
+
+    if (size < sizeof(JitFrame)) {
+	return;
+    }
+    memcpy(&frame, data, sizeof(JitFrame));
+    if (frame.version != JIT_PROTOCOL || frame.size > size) {
+	return;
+    }
+
+    end = data + frame.size;
+    for (p = data + sizeof(JitFrame); p + sizeof(JitRecord) <= end;
+	 p += sizeof(JitRecord) + rec.size) {
+	memcpy(&rec, p, sizeof(JitRecord));
+	if (p + sizeof(JitRecord) + rec.size > end) {
+	    break;
+	}
+	if ((rec.type == JIT_REC_COMPILE || rec.type == JIT_REC_HINT) &&
+	    rec.size >= 20) {
+	    memcpy(req.hash, p + sizeof(JitRecord), 16);
+	    memcpy(&req.hotness, p + sizeof(JitRecord) + 16, 4);
+	    req.hint = (rec.type == JIT_REC_HINT);
+	    req.tier = (rec.size > 20) ? p[sizeof(JitRecord) + 20] : 1;
+	    if (req.tier < 1 || req.tier > JIT_TIERS) {
+		continue;
+	    }
+	    queue->put(&req);
+	}
+    }
+}
+
+# ifdef __linux__
+static JitRing *ring;		/* ring shared with the jit module, or NULL */
+static uint8_t *ringData;	/* ring data */
+static int dataFd, roomFd;	/* eventfds for data and room */
+
+/*
+ * map the ring buffer created by the jit module
+ */
+static bool mapRing(char *argv[])
+{
+    int fd;
+    struct stat st;
+    void *map;
+
+    fd = atoi(argv[0]);
+    dataFd = atoi(argv[1]);
+    roomFd = atoi(argv[2]);
+    if (fstat(fd, &st) < 0) {
+	return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	return false;
+    }
+    fcntl(dataFd, F_SETFL, O_NONBLOCK);
+    ring = (JitRing *) map;
+    ringData = (uint8_t *) map + JIT_RING_DATA;
+    return true;
+}
+
+/*
+ * check if the ring holds entries
+ */
+static bool ringPending()
+{
+    return (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail);
+}
+
+/*
+ * announce that jitcomp is going to wait for the ring, return false if it
+ * should not because the ring holds entries
+ */
+static bool ringSleep()
+{
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ringPending()) {
+	ring->sleeping = 0;
+	return false;
+    }
+    return true;
+}
+
+/*
+ * done waiting for the ring
+ */
+static void ringWake()
+{
+    uint64_t count;
+
+    ring->sleeping = 0;
+    (void) read(dataFd, &count, sizeof(count));
+}
+
+/*
+ * take all entries from the ring
+ */
+static void readRing(CompileQueue *queue, ProgramList *programs)
+{
+    JitEntry entry;
+    uint64_t head, tail, count;
+    uint8_t *p;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (tail = ring->tail; tail != head;
+	 tail += sizeof(JitEntry) + JIT_RING_ALIGN(entry.size)) {
+	p = ringData + (tail & (ring->size - 1));
+	memcpy(&entry, p, sizeof(JitEntry));
+	p += sizeof(JitEntry);
+	switch (entry.type) {
+	case JIT_ENTRY_FRAME:
+	    putRequests(queue, p, entry.size);
+	    break;
+
+	case JIT_ENTRY_PROGRAM:
+	    if (entry.size > 16) {
+		programs->put(p, p + 16, entry.size - 16);
+	    }
+	    break;
+	}
+    }
+
+    /*
+     * make room, and wake up the jit module if it waits for that
+     */
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->full, __ATOMIC_RELAXED)) {
+	ring->full = 0;
+	count = 1;
+	(void) write(roomFd, &count, sizeof(count));
+    }
+}
+# endif
+
+/*
+ * read requests from the jit module, and add them to the queue
+ */
+static bool readRequests(CompileQueue *queue, ProgramList *programs)
+{
+    JitFrame frame;
+    uint8_t data[JIT_FRAME_MAX];
+
+# ifdef __linux__
+    if (ring != NULL) {
+	struct pollfd pfd[2];
+
+	/*
+	 * wait for the ring; the pipe only signals that the jit module is gone
+	 */
+	while (!ringPending()) {
+	    if (ringSleep()) {
+		pfd[0].fd = 0;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = dataFd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+		    return false;
+		}
+		ringWake();
+		if (pfd[0].revents != 0) {
+		    return false;
+		}
+	    }
+	}
+	readRing(queue, programs);
+	return true;
+    }
+# endif
+    if (!readAll(0, &frame, sizeof(JitFrame)) ||
+	frame.size < sizeof(JitFrame) || frame.size > JIT_FRAME_MAX) {
+	return false;
+    }
+    memcpy(data, &frame, sizeof(JitFrame));
+    if (!readAll(0, data + sizeof(JitFrame), frame.size - sizeof(JitFrame))) {
+	return false;
+    }
+    putRequests(queue, data, frame.size);
+    return true;
+}
+
+/*
+ * send a single record to the jit module, in a frame of its own
+ */
+static void record(int type, uint8_t *data, int size, int out)
+{
+    uint8_t buf[sizeof(JitFrame) + sizeof(JitRecord) + 18];
+    JitFrame frame;
+    JitRecord rec;
+
+    frame.size = sizeof(JitFrame) + sizeof(JitRecord) + size;
+    frame.version = JIT_PROTOCOL;
+    frame.nRecords = 1;
+    rec.type = type;
+    rec.size = size;
+    memcpy(buf, &frame, sizeof(JitFrame));
+    memcpy(buf + sizeof(JitFrame), &rec, sizeof(JitRecord));
+    memcpy(buf + sizeof(JitFrame) + sizeof(JitRecord), data, size);
+    (void) write(out, buf, frame.size);
+}
+
+/*
+ * report the result for a program to the jit module
+ */
+static void reply(int type, uint8_t *hash, int tier, int out)
+{
+    uint8_t data[17];
+
+    memcpy(data, hash, 16);
+    data[16] = tier;
+    record(type, data, 17, out);
+}
+
+/*
+ * check if more requests can be read without blocking
+ */
+static bool pending()
+{
+# ifndef WIN32
+    struct pollfd pfd;
+
+# ifdef __linux__
+    if (ring != NULL && ringPending()) {
+	return true;
+    }
+# endif
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    return (poll(&pfd, 1, 0) > 0);
+# else
+    DWORD avail;
+
+    return (PeekNamedPipe((HANDLE) _get_osfhandle(0), NULL, 0, NULL, &avail,
+			  NULL) && avail != 0);
+# endif
+}
+
+/*
+ * hash and tier to base filename
+ */
+static void tierName(char *buffer, uint8_t *hash, int tier)
+{
+    filename(buffer, hash);
+    if (tier > 1) {
+	sprintf(buffer + strlen(buffer), ".%d", tier);
+    }
+}
+
+/*
+ * report failure to compile a program to the jit module, with an optional
+ * reason; a transient failure was not caused by the program, and it may be
+ * compiled again later
+ */
+static void failed(uint8_t *hash, int tier, const char *reason,
+		   bool transient, int out)
+{
+    char path[48];
+    uint8_t data[18];
+    FILE *stream;
+
+    if (reason != NULL) {
+	tierName(path, hash, tier);
+	strcat(path, ".err");
+	stream = fopen(path, "w");
+	if (stream != NULL) {
+	    fprintf(stream, "%s\n", reason);
+	    fclose(stream);
+	}
+    }
+    memcpy(data, hash, 16);
+    data[16] = tier;
+    data[17] = transient;
+    record(JIT_REC_FAILED, data, 18, out);
+}
+
+/*
+ * read a file from the cache
+ */
+static CodeByte *readFile(char *path, size_t *size)
+{
+    struct stat st;
+    CodeByte *data;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+	return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return NULL;
+    }
+    data = new CodeByte[st.st_size];
+    if (!readAll(fd, data, st.st_size)) {
+	delete[] data;
+	data = NULL;
+    }
+    close(fd);
+    *size = st.st_size;
+    return data;
+}
+
+/*
+ * read a program from the cache
+ */
+static CodeByte *readProgram(uint8_t *hash, size_t *size)
+{
+    char path[42];
+
+    filename(path, hash);
+    return readFile(path, size);
+}
+
+/*
+ * read the branch counts collected for a program, if any
+ */
+static uint64_t *readProfile(uint8_t *hash, int *profileSize)
+{
+    char path[47];
+    CodeByte *data;
+    uint64_t *profile;
+    size_t size;
+
+    filename(path, hash);
+    strcat(path, ".prof");
+    data = readFile(path, &size);
+    if (data == NULL) {
+	return NULL;
+    }
+    *profileSize = size / sizeof(uint64_t);
+    profile = new uint64_t[*profileSize + 1];
+    memcpy(profile, data, *profileSize * sizeof(uint64_t));
+    delete[] data;
+    return profile;
+}
+
+# ifdef LLVM
+/*
+ * recompile a program at a higher tier from the bitcode kept for it, if
+ * any
+ */
+static bool recompile(uint8_t *hash, int tier, int out)
+{
+    char bitcode[45], path[48];
+    bool transient;
+
+    filename(bitcode, hash);
+    strcat(bitcode, ".bc");
+    if (access(bitcode, R_OK) != 0) {
+	return false;
+    }
+
+    tierName(path, hash, tier);
+    if (LLVMCompiler::recompile(bitcode, path, optLevel[tier - 1],
+				&transient)) {
+	strcat(path, ".err");
+	remove(path);
+	reply(JIT_REC_COMPILED, hash, tier, out);
+    } else {
+	failed(hash, tier, NULL, transient, out);
+    }
+    return true;
+}
+# endif
+
+/*
+ * compile the program with the given hash at the given tier, and report the
+ * result to the jit module; if the program data is not given, it is read
+ * from the cache.  Higher tiers are not instrumented, but use the branch
+ * profile of the baseline tier when there is one.
+ */
+static void compile(CodeContext *cc, int flags, uint8_t *hash, int tier,
+		    CodeByte *data, size_t size, int out)
+{
+    char path[44];
+    JitCompile comp;
+    CodeByte *prog, *ftypes, *vtypes;
+    uint64_t *profile;
+    int profileSize;
+    bool transient;
+
+    profile = NULL;
+    profileSize = 0;
+    if (tier > 1) {
+	flags &= ~JIT_PROFILE;
+	profile = readProfile(hash, &profileSize);
+# ifdef LLVM
+	if (profile == NULL && recompile(hash, tier, out)) {
+	    delete[] data;
+	    return;
+	}
+# endif
+    }
+    if (data == NULL) {
+	data = readProgram(hash, &size);
+	if (data == NULL) {
+	    /* removed from the cache, perhaps only for now */
+	    failed(hash, tier, NULL, true, out);
+	    delete[] profile;
+	    return;
+	}
+    }
+    if (size >= sizeof(JitCompile)) {
+	memcpy(&comp, data, sizeof(JitCompile));
+    }
+    if (size < sizeof(JitCompile) ||
+	size - sizeof(JitCompile) <
+			    comp.progSize + comp.fTypeSize + comp.vTypeSize) {
+	failed(hash, tier, "truncated program", false, out);
+    } else {
+	prog = data + sizeof(JitCompile);
+	ftypes = prog + comp.progSize;
+	vtypes = ftypes + comp.fTypeSize;
+
+	tierName(path, hash, tier);
+	CodeObject object(cc, comp.nInherits, ftypes, vtypes);
+	if (jitComp(&object, prog, comp.nFunctions, path, flags,
+		    optLevel[tier - 1], profile, profileSize, &transient)) {
+	    reply(JIT_REC_COMPILED, hash, tier, out);
+	} else {
+# ifdef GENCLANG
+	    /* diagnostics are in the .err file */
+	    failed(hash, tier, NULL, transient, out);
+# endif
+	}
+    }
+
+    delete[] profile;
+    delete[] data;
+}
+
+# ifndef WIN32
+/*
+ * The code generator keeps state in static variables, so programs are
+ * compiled in parallel by forked worker processes.  Each worker receives
+ * hashes on its own pipe, each followed by the tier and the size of the
+ * program data that comes next, or 0 if the program is to be read from the
+ * cache.  It reports the result to the jit module directly, and writes a
+ * byte back to the dispatcher when it is ready for more.
+ */
+struct Worker {
+    pid_t pid;			/* process ID, or 0 */
+    int request;		/* request pipe */
+    int done;			/* completion pipe */
+    bool busy;			/* compiling */
+    uint8_t hash[16];		/* program being compiled */
+    uint32_t tier;		/* tier it is compiled at */
+};
+
+/*
+ * start a worker process
+ */
+static bool startWorker(Worker *workers, int nWorkers, int n, CodeContext *cc,
+			int flags, int out)
+{
+    int req[2], done[2], i;
+    uint8_t hash[16];
+    uint32_t tier;
+    uint64_t size;
+    CodeByte *data;
+    char c;
+
+    if (pipe(req) < 0) {
+	return false;
+    }
+    if (pipe(done) < 0) {
+	close(req[0]);
+	close(req[1]);
+	return false;
+    }
+
+    workers[n].pid = fork();
+    if (workers[n].pid == 0) {
+	/*
+	 * worker: only keep its own pipes
+	 */
+	close(0);
+	close(req[1]);
+	close(done[0]);
+	for (i = 0; i < nWorkers; i++) {
+	    if (workers[i].pid != 0 && i != n) {
+		close(workers[i].request);
+		close(workers[i].done);
+	    }
+	}
+
+	c = '\0';
+	while (readAll(req[0], hash, 16) &&
+	       readAll(req[0], &tier, sizeof(tier)) &&
+	       readAll(req[0], &size, sizeof(size))) {
+	    data = NULL;
+	    if (size != 0) {
+		data = new CodeByte[size];
+		if (!readAll(req[0], data, size)) {
+		    delete[] data;
+		    break;
+		}
+	    }
+	    compile(cc, flags, hash, tier, data, size, out);
+	    if (write(done[1], &c, 1) != 1) {
+		break;
+	    }
+	}
+	_exit(0);
+    }
+
+    close(req[0]);
+    close(done[1]);
+    if (workers[n].pid < 0) {
+	workers[n].pid = 0;
+	close(req[1]);
+	close(done[0]);
+	return false;
+    }
+    workers[n].request = req[1];
+    workers[n].done = done[0];
+    workers[n].busy = false;
+    return true;
+}
+
+/*
+ * give a program to an idle worker, along with its data if available
+ */
+static bool assign(Worker *worker, JitRequest *req, ProgramList *programs)
+{
+    CodeByte *data;
+    size_t size;
+    uint64_t wsize;
+    bool result;
+
+    memcpy(worker->hash, req->hash, 16);
+    worker->tier = req->tier;
+    data = (req->tier == 1) ? programs->take(req->hash, &size) : NULL;
+    wsize = (data != NULL) ? size : 0;
+    result = (writeAll(worker->request, req->hash, 16) &&
+	      writeAll(worker->request, &req->tier, sizeof(req->tier)) &&
+	      writeAll(worker->request, &wsize, sizeof(wsize)) &&
+	      (wsize == 0 || writeAll(worker->request, data, wsize)));
+    delete[] data;
+    return result;
+}
+
+/*
+ * stop a worker process
+ */
+static void stopWorker(Worker *worker)
+{
+    close(worker->request);
+    close(worker->done);
+    waitpid(worker->pid, NULL, 0);
+    worker->pid = 0;
+}
+
+/*
+ * hand out requests to a pool of worker processes, hottest first
+ */
+static int dispatch(CodeContext *cc, int flags, int out, int nWorkers)
+{
+    Worker *workers;
+    struct pollfd *fds;
+    CompileQueue queue;
+    ProgramList programs;
+    JitRequest req;
+    int i, n, timeout;
+    char c;
+
+    signal(SIGPIPE, SIG_IGN);
+    workers = new Worker[nWorkers];
+    fds = new struct pollfd[nWorkers + 2];
+    for (i = 0; i < nWorkers; i++) {
+	workers[i].pid = 0;
+    }
+    for (i = n = 0; i < nWorkers; i++) {
+	if (startWorker(workers, nWorkers, i, cc, flags, out)) {
+	    n++;
+	}
+    }
+    if (n == 0) {
+	return 4;
+    }
+
+    for (;;) {
+	/*
+	 * give the hottest programs to idle workers
+	 */
+	for (i = 0; i < nWorkers && !queue.empty(); i++) {
+	    if (workers[i].pid == 0 &&
+		!startWorker(workers, nWorkers, i, cc, flags, out)) {
+		continue;	/* retry when there is more work */
+	    }
+	    if (!workers[i].busy) {
+		queue.get(&req);
+		workers[i].busy = assign(&workers[i], &req, &programs);
+		if (!workers[i].busy) {
+		    /* worker died, let the request be retried */
+		    failed(req.hash, req.tier, "jitcomp worker terminated",
+			   true, out);
+		    stopWorker(&workers[i]);
+		}
+	    }
+	}
+
+	fds[0].fd = 0;
+	fds[0].events = POLLIN;
+	for (i = 0; i < nWorkers; i++) {
+	    fds[i + 1].fd = (workers[i].pid != 0) ? workers[i].done : -1;
+	    fds[i + 1].events = POLLIN;
+	}
+	fds[nWorkers + 1].fd = -1;
+	fds[nWorkers + 1].events = POLLIN;
+	timeout = -1;
+# ifdef __linux__
+	if (ring != NULL) {
+	    if (ringSleep()) {
+		fds[nWorkers + 1].fd = dataFd;
+	    } else {
+		timeout = 0;
+	    }
+	}
+# endif
+	n = poll(fds, nWorkers + 2, timeout);
+# ifdef __linux__
+	if (fds[nWorkers + 1].fd >= 0) {
+	    ringWake();
+	}
+# endif
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+
+	for (i = 0; i < nWorkers; i++) {
+	    if (fds[i + 1].revents != 0) {
+		if (read(workers[i].done, &c, 1) == 1) {
+		    workers[i].busy = false;
+		} else {
+		    /* worker died, replace it */
+		    if (workers[i].busy) {
+			failed(workers[i].hash, workers[i].tier,
+			       "jitcomp worker terminated", true, out);
+		    }
+		    stopWorker(&workers[i]);
+		    startWorker(workers, nWorkers, i, cc, flags, out);
+		}
+	    }
+	}
+
+	if (fds[0].revents != 0 || pending()) {
+	    do {
+		if (!readRequests(&queue, &programs)) {
+		    goto done;
+		}
+	    } while (pending());
+	}
+    }
+
+done:
+    for (i = 0; i < nWorkers; i++) {
+	if (workers[i].pid != 0) {
+	    stopWorker(&workers[i]);
+	}
+    }
+    delete[] fds;
+    delete[] workers;
+    return 0;
+}
+# endif
+
 /*
  * main function
  */
 int main(int argc, char *argv[])
 {
     JitInfo info;
-    uint8_t cmdhash[17];
+    JitRequest req;
+    CompileQueue queue;
+    ProgramList programs;
+    CodeByte *data;
+    size_t size;
     char reply;
     int out;
     CodeByte protos[65536];
     CodeContext *cc;
 
-    if (argc != 2 || chdir(argv[1]) < 0) {
+    if ((argc != 2 && argc != 5) || chdir(argv[1]) < 0) {
+	return 1;
+    }
+# ifdef __linux__
+    if (argc == 5 && !mapRing(argv + 2)) {
 	return 1;
     }
+# endif
     mkdir("cache", 0750);
 
 # ifdef WIN32
@@ -148,40 +1180,33 @@ int main(int argc, char *argv[])
 	return 3;
     }
 
+    for (int i = 0; i < JIT_TIERS; i++) {
+	optLevel[i] = (info.optLevel[i] >= 0 && info.optLevel[i] <= 3) ?
+		       info.optLevel[i] : 0;
+    }
     cc = new CodeContext(info.intSize, info.inheritSize, protos, info.nBuiltins,
 			 info.nKfuns, info.flags & JIT_TYPECHECKING);
     reply = true;
     (void) write(out, &reply, 1);
 
-    cmdhash[0] = '\0';
-    while (read(0, cmdhash + 1, 16) == 16) {
-	char path[42];
-	JitCompile comp;
-	int fd;
-	CodeByte *prog, *ftypes, *vtypes;
-
-	filename(path, cmdhash + 1);
-	fd = open(path, O_RDONLY | O_BINARY);
-	if (fd >= 0) {
-	    (void) read(fd, &comp, sizeof(JitCompile));
-	    prog = new CodeByte[comp.progSize];
-	    ftypes = new CodeByte[comp.fTypeSize];
-	    vtypes = new CodeByte[comp.vTypeSize];
-	    (void) read(fd, prog, comp.progSize);
-	    (void) read(fd, ftypes, comp.fTypeSize);
-	    (void) read(fd, vtypes, comp.vTypeSize);
-	    close(fd);
+# ifndef WIN32
+    if (info.nWorkers > 1) {
+	return dispatch(cc, info.flags, out, info.nWorkers);
+    }
+# endif
 
-	    CodeObject object(cc, comp.nInherits, ftypes, vtypes);
-	    if (jitComp(&object, prog, comp.nFunctions, path, info.flags)) {
-		(void) write(out, cmdhash, 17);
+    for (;;) {
+	/*
+	 * collect the requests that have arrived, waiting for one if there
+	 * are none, and compile the hottest program first
+	 */
+	while (queue.empty() || pending()) {
+	    if (!readRequests(&queue, &programs)) {
+		return 0;
 	    }
-
-	    delete[] vtypes;
-	    delete[] ftypes;
-	    delete[] prog;
 	}
+	queue.get(&req);
+	data = (req.tier == 1) ? programs.take(req.hash, &size) : NULL;
+	compile(cc, info.flags, req.hash, req.tier, data, size, out);
     }
-
-    return 0;
 }
@@ -0,0 +1,302 @@
+# include <unistd.h>
+# include <fcntl.h>
+# include <sys/wait.h>
+# include <errno.h>
+# include <stdio.h>
+# include <llvm/Config/llvm-config.h>
+# include <llvm/ADT/StringMap.h>
+# include <llvm/Bitcode/BitcodeWriter.h>
+# include <llvm/IR/LLVMContext.h>
+# include <llvm/IR/Module.h>
+# include <llvm/IR/Verifier.h>
+# include <llvm/IR/LegacyPassManager.h>
+# include <llvm/IRReader/IRReader.h>
+# include <llvm/Passes/PassBuilder.h>
+# include <llvm/Support/FileSystem.h>
+# include <llvm/Support/Host.h>
+# include <llvm/Support/MemoryBuffer.h>
+# include <llvm/Support/SourceMgr.h>
+# include <llvm/Support/TargetSelect.h>
+# include <llvm/Support/raw_ostream.h>
+# if LLVM_VERSION_MAJOR >= 14
+# include <llvm/MC/TargetRegistry.h>
+# else
+# include <llvm/Support/TargetRegistry.h>
+# endif
+# include <llvm/Target/TargetMachine.h>
+# include <llvm/Target/TargetOptions.h>
+# include "llvmcomp.h"
+
+# if LLVM_VERSION_MAJOR < 14
+typedef llvm::PassBuilder::OptimizationLevel OptimizationLevel;
+# else
+typedef llvm::OptimizationLevel OptimizationLevel;
+# endif
+# if LLVM_VERSION_MAJOR >= 18
+# define OBJECT_FILE	llvm::CodeGenFileType::ObjectFile
+# else
+# define OBJECT_FILE	llvm::CGFT_ObjectFile
+# endif
+
+# ifndef LINKER
+# define LINKER		"cc"
+# endif
+
+static bool initialized;	/* native target initialized */
+
+/*
+ * The LLVM backend compiles the IR generated for an object within jitcomp,
+ * the same way as clang -fPIC -march=native -Os would, and only runs the
+ * C compiler as a separate process to link the shared object.  The IR is passed in memory, and kept in the
+ * cache as bitcode; it is only written as text when it fails to compile.
+ */
+
+/*
+ * leave a diagnostic in the .err file
+ */
+void LLVMCompiler::error(char *base, const char *message)
+{
+    char buffer[1000];
+    FILE *stream;
+
+    sprintf(buffer, "%s.err", base);
+    stream = fopen(buffer, "a");
+    if (stream != NULL) {
+	fprintf(stream, "%s\n", message);
+	fclose(stream);
+    }
+}
+
+/*
+ * write IR that failed to compile to the .ll file, for reference
+ */
+void LLVMCompiler::dump(char *base, char *ir, size_t size)
+{
+    char buffer[1000];
+    FILE *stream;
+
+    sprintf(buffer, "%s.ll", base);
+    stream = fopen(buffer, "w");
+    if (stream != NULL) {
+	fwrite(ir, 1, size, stream);
+	fclose(stream);
+    }
+}
+
+/*
+ * link the object file into a shared object with the C compiler, which
+ * knows the platform's linker options and libraries; failure to do so is
+ * not caused by the program, so it is transient
+ */
+bool LLVMCompiler::link(char *base, bool *transient)
+{
+    char obj[1000], so[1000], err[1000];
+    pid_t pid;
+    int fd, status;
+
+    sprintf(obj, "%s.o", base);
+    sprintf(so, "%s.so", base);
+    sprintf(err, "%s.err", base);
+    pid = fork();
+    if (pid == 0) {
+	fd = open(err, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+	    dup2(fd, 1);
+	    dup2(fd, 2);
+	    close(fd);
+	}
+	execlp(LINKER, LINKER, "-shared", "-o", so, obj, (char *) NULL);
+	_exit(127);
+    }
+    *transient = true;
+    if (pid < 0) {
+	error(base, "cannot run " LINKER);
+	return false;
+    }
+    while (waitpid(pid, &status, 0) < 0) {
+	if (errno != EINTR) {
+	    return false;
+	}
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/*
+ * target the host CPU, optimize and generate a shared object
+ */
+bool LLVMCompiler::build(char *base, llvm::Module *module, int level,
+			 bool *transient)
+{
+    static const OptimizationLevel levels[] = {
+	OptimizationLevel::Os, OptimizationLevel::O1, OptimizationLevel::O2,
+	OptimizationLevel::O3
+    };
+    char buffer[1000];
+    llvm::StringMap<bool> hostFeatures;
+    llvm::StringMap<bool>::iterator f;
+    std::string message, features;
+    std::error_code ec;
+    const llvm::Target *target;
+    bool result;
+
+    /*
+     * target the host CPU, like -march=native
+     */
+    target = llvm::TargetRegistry::lookupTarget(module->getTargetTriple(),
+						message);
+    if (target == NULL) {
+	error(base, message.c_str());
+	return false;
+    }
+    if (llvm::sys::getHostCPUFeatures(hostFeatures)) {
+	for (f = hostFeatures.begin(); f != hostFeatures.end(); f++) {
+	    features += (f->second) ? ",+" : ",-";
+	    features += f->first().str();
+	}
+    }
+    if (!features.empty()) {
+	features.erase(0, 1);
+    }
+    llvm::TargetOptions options;
+    std::unique_ptr<llvm::TargetMachine> machine(
+	target->createTargetMachine(module->getTargetTriple(),
+				    llvm::sys::getHostCPUName(), features,
+				    options, llvm::Reloc::PIC_));
+    if (!machine) {
+	error(base, "cannot create target machine");
+	return false;
+    }
+    module->setDataLayout(machine->createDataLayout());
+
+    /*
+     * optimize, like -Os or -O1 to -O3
+     */
+    {
+	llvm::LoopAnalysisManager lam;
+	llvm::FunctionAnalysisManager fam;
+	llvm::CGSCCAnalysisManager cgam;
+	llvm::ModuleAnalysisManager mam;
+	llvm::PassBuilder builder(machine.get());
+
+	builder.registerModuleAnalyses(mam);
+	builder.registerCGSCCAnalyses(cgam);
+	builder.registerFunctionAnalyses(fam);
+	builder.registerLoopAnalyses(lam);
+	builder.crossRegisterProxies(lam, fam, cgam, mam);
+	builder.buildPerModuleDefaultPipeline(levels[level]).run(*module, mam);
+    }
+
+    /*
+     * generate object file
+     */
+    sprintf(buffer, "%s.o", base);
+    {
+	llvm::raw_fd_ostream out(buffer, ec, llvm::sys::fs::OF_None);
+	llvm::legacy::PassManager codegen;
+
+	if (ec) {
+	    error(base, ec.message().c_str());
+	    *transient = true;
+	    return false;
+	}
+	if (machine->addPassesToEmitFile(codegen, out, NULL, OBJECT_FILE)) {
+	    out.close();
+	    remove(buffer);
+	    error(base, "cannot generate object file");
+	    return false;
+	}
+	codegen.run(*module);
+    }
+
+    result = link(base, transient);
+    remove(buffer);
+    return result;
+}
+
+/*
+ * compile IR to base.so, keeping bitcode in base.bc, and diagnostics in
+ * base.err on failure; the failure is transient if it was not caused by the
+ * IR itself
+ */
+bool LLVMCompiler::compile(char *base, char *ir, size_t size, int level,
+			   bool *transient)
+{
+    char buffer[1000];
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic diag;
+    std::string message;
+    std::error_code ec;
+
+    *transient = false;
+    if (!initialized) {
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+	initialized = true;
+    }
+
+    /*
+     * parse and verify the IR
+     */
+    sprintf(buffer, "%s.ll", base);
+    std::unique_ptr<llvm::Module> module =
+	llvm::parseIR(llvm::MemoryBufferRef(llvm::StringRef(ir, size), buffer),
+		      diag, context);
+    if (!module) {
+	llvm::raw_string_ostream stream(message);
+	diag.print("jitcomp", stream);
+	error(base, stream.str().c_str());
+	dump(base, ir, size);
+	return false;
+    }
+    {
+	llvm::raw_string_ostream stream(message);
+	if (llvm::verifyModule(*module, &stream)) {
+	    error(base, stream.str().c_str());
+	    dump(base, ir, size);
+	    return false;
+	}
+    }
+
+    /*
+     * keep the unoptimized bitcode
+     */
+    sprintf(buffer, "%s.bc", base);
+    {
+	llvm::raw_fd_ostream out(buffer, ec, llvm::sys::fs::OF_None);
+
+	if (!ec) {
+	    llvm::WriteBitcodeToFile(*module, out);
+	}
+    }
+
+    return build(base, module.get(), level, transient);
+}
+
+/*
+ * compile previously kept bitcode to base.so at another optimization level
+ */
+bool LLVMCompiler::recompile(char *bitcode, char *base, int level,
+			     bool *transient)
+{
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic diag;
+    std::string message;
+
+    *transient = false;
+    if (!initialized) {
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+	initialized = true;
+    }
+
+    std::unique_ptr<llvm::Module> module = llvm::parseIRFile(bitcode, diag,
+							    context);
+    if (!module) {
+	llvm::raw_string_ostream stream(message);
+	diag.print("jitcomp", stream);
+	error(base, stream.str().c_str());
+	return false;
+    }
+
+    return build(base, module.get(), level, transient);
+}
@@ -0,0 +1,18 @@
+namespace llvm {
+    class Module;
+}
+
+class LLVMCompiler {
+public:
+    static bool compile(char *base, char *ir, size_t size, int level,
+			bool *transient);
+    static bool recompile(char *bitcode, char *base, int level,
+			  bool *transient);
+
+private:
+    static bool build(char *base, llvm::Module *module, int level,
+		      bool *transient);
+    static bool link(char *base, bool *transient);
+    static void error(char *base, const char *message);
+    static void dump(char *base, char *ir, size_t size);
+};